@@ -0,0 +1,21 @@
+; ========================================================================
+; Negative 8-bit displacements: the disp8 byte is sign-extended, so
+; [bp - 2] addresses bp - 2 and not bp + 254.
+;
+; Final registers:
+;   ax: 7, bx: 768, cx: 9, dx: 2311 (dh read back through a direct address)
+; ========================================================================
+
+bits 16
+
+mov bp, 512
+mov word [bp - 2], 7
+mov ax, [bp - 2]
+
+; 0xFF is a valid displacement and must not read as "no displacement"
+mov bx, 768
+mov byte [bx - 1], 9
+mov cl, [bx - 1]
+
+mov dx, [510]
+mov dh, [767]
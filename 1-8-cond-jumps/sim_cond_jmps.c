@@ -1,215 +1,287 @@
-#include "../decoder/decoder.h"
+#include "../sim8086/sim8086.h"
 
-#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-typedef struct VM {
-  unsigned char *memory;
-  int memory_len;
-  unsigned char *ip;
-  unsigned char *end;
-  uint16_t registers[8];
-  uint16_t flags;
-} VM;
+static VM *signal_vm;
 
-VM new_vm(unsigned char *memory, int memory_len) {
-  VM vm = {.memory = memory,
-           .memory_len = memory_len,
-           .ip = memory,
-           .end = memory + memory_len,
-           .registers = {0, 0, 0, 0, 0, 0, 0, 0},
-           .flags = 0};
-
-  return vm;
+/** SIGUSR1 raises the timer interrupt (IRQ 0, vector 8) in the guest */
+static void on_sigusr1(int sig) {
+  (void)sig;
+  request_interrupt(signal_vm, 8);
 }
 
-size_t reg_to_index(Reg r) {
-  switch (r) {
-  case AX:
-    return 0;
-  case BX:
-    return 1;
-  case CX:
-    return 2;
-  case DX:
-    return 3;
-  case SP:
-    return 4;
-  case BP:
-    return 5;
-  case SI:
-    return 6;
-  case DI:
-    return 7;
-  default:
-    return 0;
+int main(int argc, char **argv) {
+  const char *path = NULL;
+  int show_clocks = 0;
+  Cpu cpu = CPU_8086;
+  int prefetch = 0;
+  int profile = 0;
+  int quiet = 0;
+  uint64_t sample_period = 0;
+  int sample_clocks = 0;
+  const char *folded_path = NULL;
+  const char *batch_path = NULL;
+  const char *sweep_path = NULL;
+  const char *variants_path = NULL;
+  size_t fork_at = 0;
+  const char *image_path = NULL;
+  const char *save_image_path = NULL;
+  const char *journal_path = NULL;
+  JournalMode journal_mode = JOURNAL_OFF;
+  uint64_t checkpoint_every = 0;
+  size_t checkpoint_budget = 64 << 20;
+  uint64_t back = 0;
+  const char *gdb_address = NULL;
+  uint64_t max_instrs = 0;
+  uint64_t max_clocks = 0;
+  /** --break offsets, then --watch addresses and lengths */
+  size_t *breaks = malloc(argc * sizeof(size_t));
+  int n_breaks = 0;
+  uint32_t *watches = malloc(argc * 2 * sizeof(uint32_t));
+  int n_watches = 0;
+  long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "--clocks") == 0) {
+      show_clocks = 1;
+    } else if (strcmp(argv[a], "--8088") == 0) {
+      cpu = CPU_8088;
+    } else if (strcmp(argv[a], "--prefetch") == 0) {
+      prefetch = 1;
+    } else if (strcmp(argv[a], "--profile") == 0) {
+      profile = 1;
+    } else if (strcmp(argv[a], "--quiet") == 0) {
+      quiet = 1;
+    } else if (strcmp(argv[a], "--sample") == 0 && a + 1 < argc) {
+      sample_period = strtoull(argv[++a], NULL, 10);
+    } else if (strcmp(argv[a], "--sample-clocks") == 0 && a + 1 < argc) {
+      sample_period = strtoull(argv[++a], NULL, 10);
+      sample_clocks = 1;
+    } else if (strcmp(argv[a], "--folded") == 0 && a + 1 < argc) {
+      folded_path = argv[++a];
+    } else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc) {
+      batch_path = argv[++a];
+    } else if (strcmp(argv[a], "--variants") == 0 && a + 1 < argc) {
+      variants_path = argv[++a];
+    } else if (strcmp(argv[a], "--fork-at") == 0 && a + 1 < argc) {
+      fork_at = strtoul(argv[++a], NULL, 0);
+    } else if (strcmp(argv[a], "--image") == 0 && a + 1 < argc) {
+      image_path = argv[++a];
+    } else if (strcmp(argv[a], "--save-image") == 0 && a + 1 < argc) {
+      save_image_path = argv[++a];
+    } else if (strcmp(argv[a], "--record") == 0 && a + 1 < argc) {
+      journal_path = argv[++a];
+      journal_mode = JOURNAL_RECORD;
+    } else if (strcmp(argv[a], "--replay") == 0 && a + 1 < argc) {
+      journal_path = argv[++a];
+      journal_mode = JOURNAL_REPLAY;
+    } else if (strcmp(argv[a], "--checkpoint-every") == 0 && a + 1 < argc) {
+      checkpoint_every = strtoull(argv[++a], NULL, 10);
+    } else if (strcmp(argv[a], "--checkpoint-budget") == 0 &&
+               a + 1 < argc) {
+      checkpoint_budget = strtoull(argv[++a], NULL, 10) << 20;
+    } else if (strcmp(argv[a], "--break") == 0 && a + 1 < argc) {
+      breaks[n_breaks++] = strtoul(argv[++a], NULL, 0);
+    } else if (strcmp(argv[a], "--watch") == 0 && a + 1 < argc) {
+      char *len;
+      watches[2 * n_watches] = strtoul(argv[++a], &len, 0);
+      watches[2 * n_watches + 1] = *len == ':' ? strtoul(len + 1, NULL, 0) : 1;
+      n_watches++;
+    } else if (strcmp(argv[a], "--max-instrs") == 0 && a + 1 < argc) {
+      max_instrs = strtoull(argv[++a], NULL, 10);
+    } else if (strcmp(argv[a], "--max-clocks") == 0 && a + 1 < argc) {
+      max_clocks = strtoull(argv[++a], NULL, 10);
+    } else if (strcmp(argv[a], "--gdb") == 0 && a + 1 < argc) {
+      gdb_address = argv[++a];
+    } else if (strcmp(argv[a], "--back") == 0 && a + 1 < argc) {
+      back = strtoull(argv[++a], NULL, 10);
+    } else if (strcmp(argv[a], "--sweep") == 0 && a + 1 < argc) {
+      sweep_path = argv[++a];
+    } else if (strcmp(argv[a], "--jobs") == 0 && a + 1 < argc) {
+      n_workers = strtol(argv[++a], NULL, 10);
+    } else if (path == NULL) {
+      path = argv[a];
+    } else {
+      path = NULL;
+      break;
+    }
   }
-}
-
-void print_reg_by_idx(size_t index) {
-  if (index == 0)
-    printf("ax");
-  if (index == 1)
-    printf("bx");
-  if (index == 2)
-    printf("cx");
-  if (index == 3)
-    printf("dx");
-  if (index == 4)
-    printf("sp");
-  if (index == 5)
-    printf("bp");
-  if (index == 6)
-    printf("si");
-  if (index == 7)
-    printf("di");
-}
 
-uint16_t read_reg(VM *vm, Reg src) { return vm->registers[reg_to_index(src)]; }
-
-void write_reg(VM *vm, Reg dst, uint16_t value) {
-  uint16_t current_value = read_reg(vm, dst);
-  size_t i = reg_to_index(dst);
-  print_reg_by_idx(i);
-  printf(": %d -> %d\n", current_value, value);
-  vm->registers[reg_to_index(dst)] = value;
-}
-
-void dump_registers(VM *vm) {
-  for (int i = 0; i < 8; i++) {
-    print_reg_by_idx(i);
-    printf(": %x (%d); ", vm->registers[i], vm->registers[i]);
+  if (batch_path && path == NULL) {
+    return run_batch(batch_path, n_workers > 0 ? n_workers : 1, cpu,
+                     max_instrs, max_clocks);
   }
-  printf("\n");
-  printf("ip: %p\n", vm->ip);
-}
 
-void resolve_operands(VM *vm, Operand *operands, uint16_t *resolved_operands,
-                      size_t n_operands) {
-  for (int i = 0; i < n_operands; i++) {
-    Operand op = operands[i];
-    if (op.t == IMMEDIATE) {
-      resolved_operands[i] = op.operand.imm.val;
-    } else if (op.t == REGISTER) {
-      resolved_operands[i] = read_reg(vm, op.operand.reg.r);
-    }
+  if (sweep_path && path) {
+    return run_sweep(path, sweep_path, cpu, max_instrs, max_clocks);
   }
-}
 
-void update_flags(VM *vm, uint16_t arithm_result) {
-  if (arithm_result == 0) {
-    vm->flags |= (1 << 3);
-  } else {
-    vm->flags &= ~(1 << 3);
+  if (path == NULL && image_path == NULL) {
+    fprintf(stderr,
+            "usage: %s [options] <input_binary>\n"
+            "       %s [options] --image IMAGE\n"
+            "       %s [--8088] [--jobs N] [--max-instrs N] --batch MANIFEST\n"
+            "       %s [--8088] [--max-instrs N] --sweep REGISTERS "
+            "<input_binary>\n"
+            "       %s [--8088] [--max-instrs N] --fork-at OFFSET "
+            "--variants REGISTERS <input_binary>\n"
+            "  --quiet     no per-instruction trace\n"
+            "  --clocks    show estimated clocks\n"
+            "  --8088      estimate clocks for the 8088's 8 bit bus\n"
+            "  --prefetch  model the prefetch queue in the estimate\n"
+            "  --profile   print executions and clocks per instruction\n"
+            "  --sample N  sample the running block every N instructions\n"
+            "  --sample-clocks N\n"
+            "              sample the running block every N clocks\n"
+            "  --folded FILE\n"
+            "              write clocks (or samples) per guest call path as\n"
+            "              folded stacks for flame graphs\n"
+            "  --batch MANIFEST\n"
+            "              run every binary listed in MANIFEST, one per line\n"
+            "              with optional initial registers (cx=3 bx=0x10),\n"
+            "              on a pool of --jobs threads\n"
+            "  --sweep REGISTERS\n"
+            "              run the binary once per line of initial registers\n"
+            "              in REGISTERS, many runs at once in vector lanes\n"
+            "  --fork-at OFFSET --variants REGISTERS\n"
+            "              run up to OFFSET once, then from there once per\n"
+            "              line of initial registers in REGISTERS\n"
+            "  --fork-at OFFSET --save-image IMAGE\n"
+            "              run up to OFFSET and save the VM to IMAGE\n"
+            "  --image IMAGE\n"
+            "              start from a saved VM instead of a binary\n"
+            "  --record LOG\n"
+            "              log port reads and interrupts (raised with\n"
+            "              SIGUSR1) to LOG\n"
+            "  --replay LOG\n"
+            "              re-execute a recorded run with the inputs in LOG\n"
+            "  --break OFFSET\n"
+            "              print the state whenever ip reaches OFFSET\n"
+            "  --watch ADDR[:LEN]\n"
+            "              print the state after stores to LEN bytes at ADDR\n"
+            "  --max-instrs N, --max-clocks N\n"
+            "              stop each run after N instructions or clocks\n"
+            "  --gdb PORT|SOCKET\n"
+            "              wait for gdb on a localhost port or Unix socket\n"
+            "              and run under its control\n"
+            "  --back N    step back N instructions from the end of the run\n"
+            "              before printing the state\n"
+            "  --checkpoint-every N\n"
+            "              checkpoint every N instructions to step back from\n"
+            "              (default 1000000 with --back)\n"
+            "  --checkpoint-budget MB\n"
+            "              memory for checkpoints (default 64)\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
   }
 
-  // highest bit set? then set SF
-  if (arithm_result & (1 << 15)) {
-    vm->flags |= (1 << 4);
-  } else {
-    vm->flags &= ~(1 << 4);
+  VM *vm = image_path ? vm_open_image(image_path) : vm_load(path);
+  if (vm == NULL) {
+    return 1;
   }
-}
+  vm_set_cpu(vm, cpu);
 
-void dump_flags(VM *vm) {
-  printf("flags: \nSF: %d, ZF: %d\n", (vm->flags >> 4) & 1,
-         (vm->flags >> 3) & 1);
-}
-
-void tick(VM *vm) {
-  Instruction i = parse_instr(&vm->ip);
-  print_instr(&i);
-  printf(" :: ");
-  switch (i.op_type) {
-  case MOV: {
-    MovOp m = i.op_data.mov;
-    if (m.dst.t == REGISTER) {
-      uint16_t resolved_values[1] = {0};
-      resolve_operands(vm, &m.src, resolved_values, 1);
-      write_reg(vm, m.dst.operand.reg.r, resolved_values[0]);
+  if (save_image_path) {
+    while (vm_ip(vm) < vm_program_len(vm) && vm_ip(vm) != fork_at) {
+      step(vm);
     }
-  } break;
-
-  case ADD: {
-    AddOp a = i.op_data.add;
-    if (a.dst.t == REGISTER && (a.src.t == REGISTER || a.src.t == IMMEDIATE)) {
-      Operand operands[2] = {a.dst, a.src};
-      uint16_t resolved_values[2] = {0};
-      resolve_operands(vm, operands, resolved_values, 2);
-
-      uint16_t result = resolved_values[0] + resolved_values[1];
-      write_reg(vm, a.dst.operand.reg.r, result);
-      update_flags(vm, result);
-    }
-  } break;
+    int failed = save_image(vm, save_image_path);
+    vm_destroy(vm);
+    return failed;
+  }
 
-  case SUB: {
-    SubOp s = i.op_data.sub;
-    if (s.dst.t == REGISTER && (s.src.t == REGISTER || s.src.t == IMMEDIATE)) {
-      Operand operands[2] = {s.dst, s.src};
-      uint16_t resolved_values[2] = {0, 0};
-      resolve_operands(vm, operands, resolved_values, 2);
+  if (variants_path) {
+    int failed =
+        run_variants(vm, fork_at, variants_path, max_instrs, max_clocks);
+    vm_destroy(vm);
+    return failed;
+  }
 
-      uint16_t result = resolved_values[0] - resolved_values[1];
-      write_reg(vm, s.dst.operand.reg.r, result);
-      update_flags(vm, result);
+  vm_set_trace(vm, !quiet, show_clocks);
+  /** no devices: ports read as an open bus and writes to them are lost */
+  set_default_port_handler(vm, NULL, NULL, NULL);
+  if (prefetch) {
+    enable_prefetch_model(vm);
+  }
+  if (profile) {
+    enable_profile(vm);
+  }
+  if (sample_period) {
+    enable_sampler(vm, sample_period, sample_clocks);
+  }
+  if (folded_path) {
+    enable_callpaths(vm);
+  }
+  if (journal_path && journal_open(vm, journal_path, journal_mode)) {
+    vm_destroy(vm);
+    return 1;
+  }
+  for (int i = 0; i < n_breaks; i++) {
+    if (breaks[i] < vm_program_len(vm)) {
+      set_breakpoint(vm, breaks[i]);
     }
-  } break;
-
-  case CMP: {
-    CmpOp c = i.op_data.cmp;
-    if (c.dst.t == REGISTER && (c.src.t == REGISTER || c.src.t == IMMEDIATE)) {
-      Operand operands[2] = {c.dst, c.src};
-      uint16_t resolved_values[2] = {0, 0};
-      resolve_operands(vm, operands, resolved_values, 2);
-
-      uint16_t result = resolved_values[0] - resolved_values[1];
-      update_flags(vm, result);
+  }
+  for (int i = 0; i < n_watches; i++) {
+    set_watchpoint(vm, watches[2 * i], watches[2 * i + 1]);
+  }
+  free(breaks);
+  free(watches);
+  if (back && !checkpoint_every) {
+    checkpoint_every = 1000000;
+  }
+  if (checkpoint_every) {
+    enable_checkpoints(vm, checkpoint_every, checkpoint_budget);
+  }
+  signal_vm = vm;
+  signal(SIGUSR1, on_sigusr1);
+  set_budget(vm, max_instrs, max_clocks);
+  if (gdb_address) {
+    gdb_serve(vm, gdb_address);
+  } else {
+    StopReason stopped = run(vm);
+    while (stopped == STOP_BREAKPOINT || stopped == STOP_WATCHPOINT) {
+      report_stop(vm);
+      stopped = run(vm);
     }
-  } break;
-
-  case JNE: {
-    int zf = vm->flags >> 3 & 1;
-    if (zf == 0) {
-      ConditionalJumpOp c = i.op_data.cond_jmp;
-      (vm->ip) += c.offset;
+    if (stopped != STOP_NONE) {
+      printf("stopped: %s at %zu after %" PRIu64 " instructions\n",
+             stop_reason_name(stopped), vm_ip(vm), vm_instrs(vm));
     }
   }
-
-  default:
-    return;
+  signal(SIGUSR1, SIG_DFL);
+  int diverged = journal_close(vm);
+  if (back) {
+    if (back > vm_instrs(vm) || vm_seek(vm, vm_instrs(vm) - back)) {
+      fprintf(stderr, "history does not reach %" PRIu64
+                      " instructions back\n", back);
+    } else {
+      printf("back at instruction %" PRIu64 "\n", vm_instrs(vm));
+    }
   }
-}
-
-void run(VM *vm) {
-  while (vm->ip < vm->end) {
-    tick(vm);
+  dump_registers(vm);
+  dump_flags(vm);
+  if (show_clocks) {
+    dump_clocks(vm);
   }
-}
-
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <input_binary>\n", argv[0]);
-    return 1;
+  if (profile) {
+    dump_profile(vm);
   }
-
-  FILE *f = fopen(argv[1], "r");
-  if (f == NULL) {
-    fprintf(stderr, "unable to open file %s\n", argv[1]);
-    return 1;
+  if (sample_period) {
+    dump_samples(vm);
   }
-
-  unsigned char buf[1000];
-  int buf_len = 0;
-
-  int c;
-  while ((c = getc(f)) != EOF) {
-    buf[buf_len] = c;
-    buf_len++;
+  if (folded_path) {
+    FILE *folded = fopen(folded_path, "w");
+    if (folded == NULL) {
+      fprintf(stderr, "unable to open file %s\n", folded_path);
+    } else {
+      write_folded(vm, folded);
+      fclose(folded);
+    }
   }
-
-  VM vm = new_vm(buf, buf_len);
-  run(&vm);
-  dump_registers(&vm);
-  dump_flags(&vm);
+  vm_destroy(vm);
+  return diverged;
 }
@@ -40,6 +40,13 @@ Reg parse_register(int W, unsigned char b) {
   }
 }
 
+int offset_ip_inc8(int n) {
+  if (n & 0x80) {
+    return n | ~0xFF;
+  }
+  return n;
+}
+
 Operand parse_rm_operand(int W, unsigned char **ip) {
   Mod mod = parse_mode((**ip) >> 6);
   OperandType op_type;
@@ -47,12 +54,12 @@ Operand parse_rm_operand(int W, unsigned char **ip) {
   int rm = (**ip) & 0b111;
 
   if (mod != REG) {
-    int operand3 = -1;
+    int operand3 = NO_DISP;
 
     if (mod == MEM_DISP_8) {
-      /** 8 bit displacement: need to read an extra byte */
+      /** 8 bit displacement: need to read an extra byte, sign-extended */
       (*ip)++;
-      operand3 = **ip;
+      operand3 = offset_ip_inc8(**ip);
     } else if (mod == MEM_DISP_16) {
       /** 16 bit displacement: need to read two extra bytes */
       (*ip)++;
@@ -101,19 +108,10 @@ Operand parse_rm_operand(int W, unsigned char **ip) {
         op_type = DIRECT_ADDR;
         (*ip)++;
         int lo = **ip;
-        DirectAddr dal;
-        if (W) {
-          /**
-           * if W is set, we need to read another byte (DISP high) to get the 16
-           * bit value
-           */
-          (*ip)++;
-          int hi = **ip;
-          int combined = (hi << 8) | lo;
-          dal.addr = combined;
-        } else {
-          dal.addr = lo;
-        }
+        /** the direct address is always 16 bits, regardless of W */
+        (*ip)++;
+        int hi = **ip;
+        DirectAddr dal = {.addr = (hi << 8) | lo};
         op_data.addr = dal;
       } else {
         EffectiveAddr eal = {
@@ -156,7 +154,7 @@ Operand parse_immediate(int W, unsigned char **ip) {
   return op;
 }
 
-void parse_operands_reg_rm(unsigned char **ip, Operand ops[]) {
+int parse_operands_reg_rm(unsigned char **ip, Operand ops[]) {
   int W = **ip & 1;
   int D = (**ip >> 1) & 1;
   (*ip)++;
@@ -181,6 +179,7 @@ void parse_operands_reg_rm(unsigned char **ip, Operand ops[]) {
 
   ops[0] = dst;
   ops[1] = src;
+  return W;
 }
 
 Instruction parse_mov_im_reg(unsigned char **ip) {
@@ -193,36 +192,37 @@ Instruction parse_mov_im_reg(unsigned char **ip) {
 
   Operand op_imm = parse_immediate(W, ip);
   OpData op = {.mov = {.dst = dst_operand, .src = op_imm}};
-  Instruction i = {.op_type = MOV, .op_data = op};
+  Instruction i = {.op_type = MOV, .op_data = op, .wide = W};
 
   return i;
 }
 
 Instruction parse_mov_im_rm(unsigned char **ip) {
   int W = (**ip) & 1;
+  (*ip)++;
   Operand op_dst = parse_rm_operand(W, ip);
   Operand op_imm = parse_immediate(W, ip);
   MovOp mov = {.dst = op_dst, .src = op_imm};
   OpData op = {.mov = mov};
-  Instruction i = {.op_type = MOV, .op_data = op};
+  Instruction i = {.op_type = MOV, .op_data = op, .wide = W};
   return i;
 }
 
 Instruction parse_mov_reg_rm(unsigned char **ip) {
   Operand ops[2];
-  parse_operands_reg_rm(ip, ops);
+  int W = parse_operands_reg_rm(ip, ops);
   MovOp mov = {.dst = ops[0], .src = ops[1]};
   OpData op = {.mov = mov};
-  Instruction i = {.op_type = MOV, .op_data = op};
+  Instruction i = {.op_type = MOV, .op_data = op, .wide = W};
   return i;
 }
 
 Instruction parse_add_reg_rm(unsigned char **ip) {
   Operand ops[2];
-  parse_operands_reg_rm(ip, ops);
+  int W = parse_operands_reg_rm(ip, ops);
   AddOp add = {.dst = ops[0], .src = ops[1]};
   OpData op = {.add = add};
-  Instruction i = {.op_type = ADD, .op_data = op};
+  Instruction i = {.op_type = ADD, .op_data = op, .wide = W};
   return i;
 }
 
@@ -232,9 +232,13 @@ Instruction parse_add_im_rm(unsigned char **ip) {
   (*ip)++;
   Operand op_dst = parse_rm_operand(W, ip);
   Operand op_imm = parse_immediate(S == 0 && W == 1 ? 1 : 0, ip);
+  if (S && W) {
+    /** 8 bit immediate, sign-extended to 16 bits */
+    op_imm.operand.imm.val = offset_ip_inc8(op_imm.operand.imm.val);
+  }
   AddOp add = {.dst = op_dst, .src = op_imm};
   OpData op = {.add = add};
-  Instruction i = {.op_type = ADD, .op_data = op};
+  Instruction i = {.op_type = ADD, .op_data = op, .wide = W};
   return i;
 }
 
@@ -247,16 +251,16 @@ Instruction parse_add_im_to_acc(unsigned char **ip) {
   Operand src = parse_immediate(W, ip);
   AddOp add = {.dst = dst, .src = src};
   OpData op = {.add = add};
-  Instruction i = {.op_type = ADD, .op_data = op};
+  Instruction i = {.op_type = ADD, .op_data = op, .wide = W};
   return i;
 }
 
 Instruction parse_sub_reg_rm(unsigned char **ip) {
   Operand ops[2];
-  parse_operands_reg_rm(ip, ops);
+  int W = parse_operands_reg_rm(ip, ops);
   SubOp sub = {.dst = ops[0], .src = ops[1]};
   OpData op = {.sub = sub};
-  Instruction i = {.op_type = SUB, .op_data = op};
+  Instruction i = {.op_type = SUB, .op_data = op, .wide = W};
   return i;
 }
 
@@ -266,9 +270,13 @@ Instruction parse_sub_im_rm(unsigned char **ip) {
   (*ip)++;
   Operand op_dst = parse_rm_operand(W, ip);
   Operand op_imm = parse_immediate(S == 0 && W == 1 ? 1 : 0, ip);
+  if (S && W) {
+    /** 8 bit immediate, sign-extended to 16 bits */
+    op_imm.operand.imm.val = offset_ip_inc8(op_imm.operand.imm.val);
+  }
   SubOp sub = {.dst = op_dst, .src = op_imm};
   OpData op = {.sub = sub};
-  Instruction i = {.op_type = SUB, .op_data = op};
+  Instruction i = {.op_type = SUB, .op_data = op, .wide = W};
   return i;
 }
 
@@ -281,16 +289,16 @@ Instruction parse_sub_im_to_acc(unsigned char **ip) {
   Operand src = parse_immediate(W, ip);
   SubOp sub = {.dst = dst, .src = src};
   OpData op = {.sub = sub};
-  Instruction i = {.op_type = SUB, .op_data = op};
+  Instruction i = {.op_type = SUB, .op_data = op, .wide = W};
   return i;
 }
 
 Instruction parse_cmp_reg_rm(unsigned char **ip) {
   Operand ops[2];
-  parse_operands_reg_rm(ip, ops);
+  int W = parse_operands_reg_rm(ip, ops);
   CmpOp cmp = {.dst = ops[0], .src = ops[1]};
   OpData op = {.cmp = cmp};
-  Instruction i = {.op_type = CMP, .op_data = op};
+  Instruction i = {.op_type = CMP, .op_data = op, .wide = W};
   return i;
 }
 
@@ -300,9 +308,13 @@ Instruction parse_cmp_im_rm(unsigned char **ip) {
   (*ip)++;
   Operand op_dst = parse_rm_operand(W, ip);
   Operand op_imm = parse_immediate(S == 0 && W == 1 ? 1 : 0, ip);
+  if (S && W) {
+    /** 8 bit immediate, sign-extended to 16 bits */
+    op_imm.operand.imm.val = offset_ip_inc8(op_imm.operand.imm.val);
+  }
   CmpOp cmp = {.dst = op_dst, .src = op_imm};
   OpData op = {.cmp = cmp};
-  Instruction i = {.op_type = CMP, .op_data = op};
+  Instruction i = {.op_type = CMP, .op_data = op, .wide = W};
   return i;
 }
 
@@ -315,15 +327,130 @@ Instruction parse_cmp_im_to_acc(unsigned char **ip) {
   Operand src = parse_immediate(W, ip);
   CmpOp cmp = {.dst = dst, .src = src};
   OpData op = {.cmp = cmp};
-  Instruction i = {.op_type = CMP, .op_data = op};
+  Instruction i = {.op_type = CMP, .op_data = op, .wide = W};
   return i;
 }
 
-int offset_ip_inc8(int n) {
-  if (n & 0x80) {
-    return n | ~0xFF;
+/** IN and OUT: port in the byte after the opcode, or in DX (bit 3 set) */
+Instruction parse_in_out(unsigned char **ip) {
+  int W = **ip & 1;
+  int variable = (**ip >> 3) & 1;
+  Op op_type = (**ip >> 1) & 1 ? OUT : IN;
+  (*ip)++;
+
+  Register acc = {.r = W ? AX : AL};
+  Operand acc_operand = {.t = REGISTER, .operand = {.reg = acc}};
+  Operand port;
+  if (variable) {
+    Register dx = {.r = DX};
+    port.t = REGISTER;
+    port.operand.reg = dx;
+  } else {
+    port = parse_immediate(0, ip);
   }
-  return n;
+
+  PortOp p = {.port = port, .acc = acc_operand};
+  OpData op = {.port = p};
+  Instruction i = {.op_type = op_type, .op_data = op, .wide = W};
+  return i;
+}
+
+/** PUSH and POP of a register (opcode bits 0-2) or, after 0xFF/0x8F, r/m */
+Instruction parse_push_pop(unsigned char **ip) {
+  int b0 = **ip;
+  Op op_type = b0 == 0b10001111 || (b0 >> 3) == 0b01011 ? POP : PUSH;
+  Operand operand;
+  if (b0 >> 4 == 0b0101) {
+    Register reg = {.r = parse_register(1, b0 & 0b111)};
+    operand.t = REGISTER;
+    operand.operand.reg = reg;
+    (*ip)++;
+  } else {
+    (*ip)++;
+    operand = parse_rm_operand(1, ip);
+  }
+
+  StackOp stack = {.operand = operand};
+  OpData op = {.stack = stack};
+  Instruction i = {.op_type = op_type, .op_data = op, .wide = 1};
+  return i;
+}
+
+/** MOVS, CMPS, STOS, LODS and SCAS (A4-A7, AA-AF) */
+int is_string_op(int b) {
+  int op = b >> 1;
+  return op == 0b1010010 || op == 0b1010011 ||
+         (op >= 0b1010101 && op <= 0b1010111);
+}
+
+/** a string instruction, after an optional REP/REPE (F3) or REPNE (F2) */
+Instruction parse_string(unsigned char **ip) {
+  RepPrefix rep = NO_REP;
+  if (**ip == 0b11110011) {
+    rep = REPE;
+    (*ip)++;
+  } else if (**ip == 0b11110010) {
+    rep = REPNE;
+    (*ip)++;
+  }
+
+  int W = **ip & 1;
+  Op op_type;
+  switch (**ip >> 1) {
+  case 0b1010010:
+    op_type = MOVS;
+    break;
+  case 0b1010011:
+    op_type = CMPS;
+    break;
+  case 0b1010101:
+    op_type = STOS;
+    break;
+  case 0b1010110:
+    op_type = LODS;
+    break;
+  default:
+    op_type = SCAS;
+    break;
+  }
+  (*ip)++;
+
+  StringOp string = {.rep = rep};
+  OpData op = {.string = string};
+  Instruction i = {.op_type = op_type, .op_data = op, .wide = W};
+  return i;
+}
+
+/**
+ * The F6/F7 group (TEST, NOT, NEG, MUL, IMUL, DIV, IDIV; /1 is TEST on the
+ * 8086) and the D0-D3 group of shifts and rotates, by 1 or by CL (bit 1)
+ */
+Instruction parse_group(unsigned char **ip) {
+  static const Op f6_ops[] = {TEST, TEST, NOT, NEG, MUL, IMUL, DIV, IDIV};
+  static const Op d0_ops[] = {ROL, ROR, RCL, RCR, SHL, SHR, UNKNOWN_OP, SAR};
+  int b0 = **ip;
+  int W = b0 & 1;
+  int shift = b0 >> 2 == 0b110100;
+  (*ip)++;
+
+  int reg = (**ip >> 3) & 0b111;
+  Op op_type = shift ? d0_ops[reg] : f6_ops[reg];
+  GroupOp group = {.dst = parse_rm_operand(W, ip)};
+  if (op_type == TEST) {
+    group.src = parse_immediate(W, ip);
+  } else if (shift && (b0 >> 1 & 1)) {
+    Register cl = {.r = CL};
+    group.src.t = REGISTER;
+    group.src.operand.reg = cl;
+  } else {
+    Immediate one = {.val = 1};
+    group.src.t = IMMEDIATE;
+    group.src.operand.imm = one;
+  }
+
+  OpData op = {.group = group};
+  Instruction i = {.op_type = op_type, .op_data = op, .wide = W};
+  return i;
 }
 
 Instruction parse_instr(unsigned char **ip) {
@@ -499,31 +626,114 @@ Instruction parse_instr(unsigned char **ip) {
   }
 
   if (b0 == 0b11100010) {
-    Instruction i = {.op_type = LOOP, .op_data = {.cond_jmp = {.offset = b1}}};
+    Instruction i = {.op_type = LOOP,
+                     .op_data = {.cond_jmp = {.offset = offset_ip_inc8(b1)}}};
     (*ip) += 2;
     return i;
   }
 
   if (b0 == 0b11100001) {
-    Instruction i = {.op_type = LOOPZ, .op_data = {.cond_jmp = {.offset = b1}}};
+    Instruction i = {.op_type = LOOPZ,
+                     .op_data = {.cond_jmp = {.offset = offset_ip_inc8(b1)}}};
     (*ip) += 2;
     return i;
   }
 
   if (b0 == 0b11100000) {
     Instruction i = {.op_type = LOOPNZ,
-                     .op_data = {.cond_jmp = {.offset = b1}}};
+                     .op_data = {.cond_jmp = {.offset = offset_ip_inc8(b1)}}};
     (*ip) += 2;
     return i;
   }
 
   if (b0 == 0b11100011) {
-    Instruction i = {.op_type = JCXZ, .op_data = {.cond_jmp = {.offset = b1}}};
+    Instruction i = {.op_type = JCXZ,
+                     .op_data = {.cond_jmp = {.offset = offset_ip_inc8(b1)}}};
     (*ip) += 2;
     return i;
   }
   /** CONDITIONAL JUMPS END */
 
+  /** IN/OUT */
+  if ((b0 & 0b11110100) == 0b11100100) {
+    return parse_in_out(ip);
+  }
+  /** IN/OUT END */
+
+  /** INTERRUPTS */
+  if (b0 == 0b11001101) {
+    Instruction i = {.op_type = INT, .op_data = {.intr = {.vector = b1}}};
+    (*ip) += 2;
+    return i;
+  }
+
+  if (b0 == 0b11001100) {
+    Instruction i = {.op_type = INT, .op_data = {.intr = {.vector = 3}}};
+    (*ip)++;
+    return i;
+  }
+
+  if (b0 == 0b11001111) {
+    Instruction i = {.op_type = IRET};
+    (*ip)++;
+    return i;
+  }
+
+  if (b0 == 0b11111010 || b0 == 0b11111011) {
+    Instruction i = {.op_type = b0 & 1 ? STI : CLI};
+    (*ip)++;
+    return i;
+  }
+  /** INTERRUPTS END */
+
+  /** STACK */
+  if (b0 >> 4 == 0b0101 ||
+      (b0 == 0b11111111 && ((b1 >> 3) & 0b111) == 0b110) ||
+      (b0 == 0b10001111 && ((b1 >> 3) & 0b111) == 0b000)) {
+    return parse_push_pop(ip);
+  }
+
+  if (b0 == 0b11101000) {
+    /** the offset is 16 bits: sign-extend it */
+    int offset = (int16_t)(b1 | (*ip)[2] << 8);
+    Instruction i = {.op_type = CALL, .op_data = {.call = {.offset = offset}}};
+    (*ip) += 3;
+    return i;
+  }
+
+  if (b0 == 0b11000011) {
+    Instruction i = {.op_type = RET, .op_data = {.ret = {.pop = 0}}};
+    (*ip)++;
+    return i;
+  }
+
+  if (b0 == 0b11000010) {
+    int pop = b1 | (*ip)[2] << 8;
+    Instruction i = {.op_type = RET, .op_data = {.ret = {.pop = pop}}};
+    (*ip) += 3;
+    return i;
+  }
+  /** STACK END */
+
+  /** STRINGS */
+  if (is_string_op(b0) ||
+      ((b0 == 0b11110011 || b0 == 0b11110010) && is_string_op(b1))) {
+    return parse_string(ip);
+  }
+
+  if (b0 == 0b11111100 || b0 == 0b11111101) {
+    Instruction i = {.op_type = b0 & 1 ? STD : CLD};
+    (*ip)++;
+    return i;
+  }
+  /** STRINGS END */
+
+  /** MULTIPLY, DIVIDE, SHIFTS */
+  if (b0 >> 1 == 0b1111011 || b0 >> 2 == 0b110100) {
+    return parse_group(ip);
+  }
+  /** MULTIPLY, DIVIDE, SHIFTS END */
+
   (*ip)++;
   Instruction i = {.op_type = UNKNOWN_OP, .op_data = {.unkn = {}}};
   return i;
@@ -597,8 +807,11 @@ void print_operand(Operand *o) {
       print_reg(&o->operand.e_addr.operand2);
     }
 
-    if (o->operand.e_addr.operand3 != -1) {
-      printf(" + %d", o->operand.e_addr.operand3);
+    int disp = o->operand.e_addr.operand3;
+    if (disp < 0 && disp != NO_DISP) {
+      printf(" - %d", -disp);
+    } else if (disp != NO_DISP) {
+      printf(" + %d", disp);
     }
     printf("]");
     break;
@@ -699,9 +912,96 @@ void print_instr(Instruction *i) {
     break;
     break;
   case JCXZ:
-    printf("jxcz %d", i->op_data.cond_jmp.offset);
+    printf("jcxz %d", i->op_data.cond_jmp.offset);
+    break;
+    break;
+  case IN:
+    printf("in ");
+    print_operand(&i->op_data.port.acc);
+    printf(", ");
+    print_operand(&i->op_data.port.port);
+    break;
+  case OUT:
+    printf("out ");
+    print_operand(&i->op_data.port.port);
+    printf(", ");
+    print_operand(&i->op_data.port.acc);
+    break;
+  case INT:
+    printf("int %d", i->op_data.intr.vector);
     break;
+  case IRET:
+    printf("iret");
     break;
+  case PUSH:
+    printf("push ");
+    print_operand(&i->op_data.stack.operand);
+    break;
+  case POP:
+    printf("pop ");
+    print_operand(&i->op_data.stack.operand);
+    break;
+  case CALL:
+    printf("call %d", i->op_data.call.offset);
+    break;
+  case RET:
+    if (i->op_data.ret.pop) {
+      printf("ret %d", i->op_data.ret.pop);
+    } else {
+      printf("ret");
+    }
+    break;
+  case MOVS:
+  case CMPS:
+  case STOS:
+  case LODS:
+  case SCAS: {
+    static const char *names[] = {"movs", "cmps", "stos", "lods", "scas"};
+    RepPrefix rep = i->op_data.string.rep;
+    int compares = i->op_type == CMPS || i->op_type == SCAS;
+    if (rep == REPNE) {
+      printf("repne ");
+    } else if (rep == REPE) {
+      printf(compares ? "repe " : "rep ");
+    }
+    printf("%s%c", names[i->op_type - MOVS], i->wide ? 'w' : 'b');
+  } break;
+  case CLD:
+    printf("cld");
+    break;
+  case STD:
+    printf("std");
+    break;
+  case CLI:
+    printf("cli");
+    break;
+  case STI:
+    printf("sti");
+    break;
+  case TEST:
+  case NOT:
+  case NEG:
+  case MUL:
+  case IMUL:
+  case DIV:
+  case IDIV:
+  case ROL:
+  case ROR:
+  case RCL:
+  case RCR:
+  case SHL:
+  case SHR:
+  case SAR: {
+    static const char *names[] = {"test", "not", "neg", "mul", "imul",
+                                  "div", "idiv", "rol", "ror", "rcl",
+                                  "rcr", "shl", "shr", "sar"};
+    printf("%s ", names[i->op_type - TEST]);
+    print_operand(&i->op_data.group.dst);
+    if (i->op_type == TEST || i->op_type >= ROL) {
+      printf(", ");
+      print_operand(&i->op_data.group.src);
+    }
+  } break;
   case UNKNOWN_OP:
     printf("UNKN");
     break;
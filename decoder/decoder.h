@@ -25,12 +25,15 @@ typedef struct DirectAddr {
   int addr;
 } DirectAddr;
 
+/** EffectiveAddr.operand3 when the equation has no displacement */
+#define NO_DISP (-0x10000)
+
 typedef struct EffectiveAddr {
   /** first register of the equation */
   Reg operand1;
   /** second register of the equation, nullable */
   Reg operand2;
-  /** resolved value (from displacement), nullable */
+  /** resolved value (from displacement), NO_DISP if absent */
   int operand3;
 } EffectiveAddr;
 
@@ -95,6 +98,50 @@ typedef struct ConditionalJumpOp {
   int offset;
 } ConditionalJumpOp;
 
+typedef struct PortOp {
+  /** IMMEDIATE port number, or REGISTER DX */
+  Operand port;
+  /** AL or AX */
+  Operand acc;
+} PortOp;
+
+typedef struct IntOp {
+  int vector;
+} IntOp;
+
+typedef struct StackOp {
+  /** REGISTER, or memory operand; always 16 bits */
+  Operand operand;
+} StackOp;
+
+typedef struct CallOp {
+  /** offset relative to the next instruction */
+  int offset;
+} CallOp;
+
+typedef struct RetOp {
+  /** bytes popped off the stack on top of the return address */
+  int pop;
+} RetOp;
+
+typedef enum RepPrefix {
+  NO_REP,
+  /** REP, or REPE for CMPS and SCAS */
+  REPE,
+  REPNE,
+} RepPrefix;
+
+typedef struct StringOp {
+  RepPrefix rep;
+} StringOp;
+
+/** the 0xF6/0xF7 and 0xD0-0xD3 groups: one register or memory operand */
+typedef struct GroupOp {
+  Operand dst;
+  /** TEST: the immediate; shifts and rotates: IMMEDIATE 1 or REGISTER CL */
+  Operand src;
+} GroupOp;
+
 typedef union OpData {
   MovOp mov;
   UnknownOp unkn;
@@ -102,6 +149,13 @@ typedef union OpData {
   SubOp sub;
   CmpOp cmp;
   ConditionalJumpOp cond_jmp;
+  PortOp port;
+  IntOp intr;
+  StackOp stack;
+  CallOp call;
+  RetOp ret;
+  StringOp string;
+  GroupOp group;
 } OpData;
 
 typedef enum Op {
@@ -129,12 +183,45 @@ typedef enum Op {
   LOOPZ,
   LOOPNZ,
   JCXZ,
+  IN,
+  OUT,
+  INT,
+  IRET,
+  PUSH,
+  POP,
+  CALL,
+  RET,
+  MOVS,
+  CMPS,
+  STOS,
+  LODS,
+  SCAS,
+  CLD,
+  STD,
+  CLI,
+  STI,
+  TEST,
+  NOT,
+  NEG,
+  MUL,
+  IMUL,
+  DIV,
+  IDIV,
+  ROL,
+  ROR,
+  RCL,
+  RCR,
+  SHL,
+  SHR,
+  SAR,
   UNKNOWN_OP,
 } Op;
 
 typedef struct Instruction {
   Op op_type;
   OpData op_data;
+  /** W bit: operates on 16 bit (1) or 8 bit (0) values */
+  int wide;
 } Instruction;
 
 Instruction parse_instr(unsigned char **ip);
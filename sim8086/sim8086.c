@@ -0,0 +1,5318 @@
+#include "sim8086.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/** 8086 address space: 1 MiB */
+#define MEMORY_SIZE (1 << 20)
+
+/** granularity of copy-on-write snapshots */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define N_PAGES (MEMORY_SIZE >> PAGE_SHIFT)
+
+/**
+ * Register file slot that always holds 0, so that effective addresses can be
+ * computed as base + index + disp without checking for missing registers
+ */
+#define ZERO_SLOT 8
+
+/**
+ * VM.page_traps bits: why stores to a page take the slow path (and for
+ * PAGE_MMIO loads too)
+ */
+#define PAGE_COW 1
+#define PAGE_WATCHED 2
+#define PAGE_ROM 4
+#define PAGE_MMIO 8
+#define PAGE_CODE 16
+
+/** VM.leaders bits: why a block starts at an offset */
+#define LEADER_JUMP 1
+#define LEADER_BREAKPOINT 2
+
+typedef struct Decoded Decoded;
+
+/**
+ * Saved VM state that memory is restored to lazily: taking a snapshot only
+ * copies the registers, and each page is copied the first time it is
+ * written afterwards. Restoring copies back just those pages, so both cost
+ * O(pages touched) rather than a copy of all of memory.
+ */
+struct Snapshot {
+  uint16_t registers[8];
+  uint16_t flags;
+  size_t ip;
+  uint64_t clocks;
+  uint64_t instrs;
+  /** original contents of page p at p * PAGE_SIZE, for the saved pages */
+  unsigned char *pages;
+  uint16_t saved[N_PAGES];
+  int n_saved;
+};
+
+/** executes one predecoded instruction of a fixed operand shape */
+typedef void (*Handler)(VM *vm, Decoded *d);
+
+/**
+ * An instruction decoded once, before execution starts. Operands are resolved
+ * to register file slots (and for memory operands the base and index slots
+ * plus displacement), and the handler is picked for the operand shape, so
+ * nothing about operand types is looked at again while running.
+ */
+struct Decoded {
+  Handler exec;
+  Instruction instr;
+  /** length of the encoded instruction in bytes */
+  uint8_t len;
+  /** register slot: index into registers (16 bit) or registers8 (8 bit) */
+  uint8_t dst;
+  uint8_t src;
+  /** memory operand: slots of the address registers, ZERO_SLOT if unused */
+  uint8_t ea_base;
+  uint8_t ea_index;
+  /** memory operand: displacement or direct address */
+  uint16_t disp;
+  uint16_t imm;
+  /**
+   * Jumps and CALL: offset of the target, resolved once at decode time.
+   * Past memory_len for targets outside the program (negative ones wrap).
+   */
+  uint32_t target;
+  /** estimated 8086 clocks: base + ea_clocks (jumps: when not taken) */
+  uint16_t clocks;
+  uint8_t ea_clocks;
+  /** jumps: clocks added on top of `clocks` when the jump is taken */
+  uint8_t taken_clocks;
+  /** MOV/ADD/SUB/CMP: the Shape the handler was picked for */
+  uint8_t shape;
+  /** memory operand transfers over the bus (2 for read-modify-write) */
+  uint8_t transfers;
+};
+
+/**
+ * A basic block: a run of predecoded instructions entered only at the top and
+ * left only after the last one, which is the only one that can be a jump.
+ * Blocks are kept in a flat array indexed by the ip offset they start at.
+ */
+typedef struct Block {
+  /** 0 while no block has been built at this offset */
+  uint16_t n_instrs;
+  /** ip offset just past the last instruction */
+  uint32_t end;
+  /** sum of the instructions' clocks (jumps counted as not taken) */
+  uint32_t clocks;
+} Block;
+
+/**
+ * Bus interface unit model: the BIU fills the prefetch queue whenever the bus
+ * is free while the EU executes, and the EU stalls when the queue holds fewer
+ * bytes than the next instruction needs. A bus cycle takes 4 clocks.
+ */
+typedef struct Biu {
+  int enabled;
+  /** queue size in bytes: 6 on the 8086, 4 on the 8088 */
+  uint8_t capacity;
+  /** bytes per bus cycle: 2 on the 8086, 1 on the 8088 */
+  uint8_t fetch_bytes;
+  uint8_t fill;
+  /** free bus clocks carried over towards the next fetch */
+  uint8_t idle;
+  /** clocks the EU spent waiting for instruction bytes */
+  uint64_t stalls;
+} Biu;
+
+/**
+ * Hotspot profile entry: executions and estimated clocks (including queue
+ * stalls) of the instruction at one ip offset. The block loop counts the
+ * runs of the block starting here instead, and adds them to the entries of
+ * its instructions later (see flush_block_runs).
+ */
+typedef struct ProfileEntry {
+  uint64_t hits;
+  uint64_t clocks;
+  /** runs of the block from here to run_end not yet added to hits */
+  uint64_t runs;
+  uint32_t run_end;
+} ProfileEntry;
+
+/**
+ * Sampling profiler: a sample every `period` instructions (or clocks). The
+ * next one is a deadline of the run loops like the budget, so nothing is
+ * counted between samples. A sample goes to the code about to run.
+ */
+typedef struct Sampler {
+  /** 0 when sampling is off */
+  uint64_t period;
+  int by_clocks;
+  /** instruction count (or clocks) of the next sample */
+  uint64_t next_at;
+  uint64_t n_samples;
+  /** samples per ip offset */
+  uint64_t *hits;
+} Sampler;
+
+/** A node of the guest calling context tree: one full call path */
+typedef struct CallPath {
+  /** offset of the called routine; unused for the root (top level) */
+  uint32_t entry;
+  uint32_t parent;
+  uint64_t instrs;
+  uint64_t clocks;
+  uint64_t samples;
+} CallPath;
+
+/**
+ * Shadow call stack over the calling context tree. Calls look up (or add)
+ * the child path in an open addressing table keyed on (parent, entry), and
+ * returns pop back to the caller's path, so both are O(1) (amortized over
+ * table and stack growth). Execution is attributed to `current`.
+ */
+typedef struct CallPaths {
+  /** nodes[0] is the root; NULL when call paths are not tracked */
+  CallPath *nodes;
+  uint32_t n_nodes;
+  uint32_t cap_nodes;
+  /** edge table: (parent << 32 | entry) -> child; child 0 marks empty */
+  uint64_t *edge_keys;
+  uint32_t *edge_children;
+  uint32_t cap_edges;
+  /** call paths of the callers of current, and where their calls return */
+  uint32_t *stack;
+  uint32_t *returns;
+  uint32_t depth;
+  uint32_t cap_stack;
+  uint32_t current;
+} CallPaths;
+
+typedef enum EventKind {
+  /** end of the log: the final instruction count and a hash of the state */
+  EVENT_END,
+  EVENT_PORT_IN,
+  EVENT_INTERRUPT,
+  EVENT_MMIO_IN,
+} EventKind;
+
+/** a nondeterministic input, as it is logged */
+typedef struct Event {
+  EventKind kind;
+  /** interrupts and the end: instructions retired before it */
+  uint64_t instrs;
+  /** port, interrupt vector or memory address */
+  uint32_t arg;
+  /** port value, or the state hash of the end */
+  uint64_t value;
+} Event;
+
+/**
+ * Record/replay log of the inputs that make a run nondeterministic: port
+ * reads and interrupts requested by the host. Everything else follows from
+ * the program, so a run is replayed bit-exactly by feeding the same inputs
+ * back at the same instruction counts. Events are varint encoded, with
+ * interrupts timed as the delta since the previous one.
+ */
+typedef struct Journal {
+  JournalMode mode;
+  FILE *f;
+  /** instruction count of the last interrupt, the base of the next delta */
+  uint64_t last_instrs;
+  uint64_t n_events;
+  /** replay: the next logged event, read ahead */
+  Event next;
+  /** replay: where next starts in the log, and the delta base it used */
+  long next_offset;
+  uint64_t next_base;
+  int diverged;
+} Journal;
+
+/** where the inputs after a checkpoint start in the history */
+typedef struct HistoryMark {
+  long offset;
+  uint64_t base;
+} HistoryMark;
+
+/**
+ * Time-travel history: a checkpoint every `interval` instructions. Each one
+ * is a Snapshot that the pages written after it are saved into, so taking
+ * one costs no copying and checkpoint k holds exactly the pages changed
+ * between it and checkpoint k + 1. Going back to k undoes the newer ones,
+ * newest first, at O(pages written since k).
+ *
+ * The inputs of the run since the oldest checkpoint are kept in `history`,
+ * an in-memory log in the Journal encoding. Going back swaps a replay of it
+ * in for the VM's journal, so re-executing (and running on) reads the same
+ * inputs in the same places; once the replay has fed its last input the
+ * VM's own journal and devices take over again.
+ */
+typedef struct Timeline {
+  /** 0 when no checkpoints are taken */
+  uint64_t interval;
+  /** bytes of saved pages to keep before dropping the oldest checkpoint */
+  size_t budget;
+  Snapshot **checkpoints;
+  /** per checkpoint, where its inputs start in the history */
+  HistoryMark *marks;
+  int n_checkpoints;
+  int cap_checkpoints;
+  uint64_t next_at;
+  /** recorded inputs, in the buffer of an open_memstream */
+  Journal history;
+  char *log;
+  size_t log_len;
+  /** replaying the history: the VM's own journal, swapped out meanwhile */
+  int replaying;
+  Journal live;
+} Timeline;
+
+/**
+ * A watched range of memory. A store into it stops the run at the end of the
+ * block that made it (right after the store in the per-instruction loops).
+ */
+typedef struct Watch {
+  uint32_t addr;
+  uint32_t len;
+} Watch;
+
+typedef struct PortHandler {
+  PortIn in;
+  PortOut out;
+  void *ctx;
+} PortHandler;
+
+typedef struct MmioHandler {
+  MmioRead read;
+  MmioWrite write;
+  void *ctx;
+} MmioHandler;
+
+/** a device event due when the clock estimate reaches `at` */
+typedef struct Timer {
+  uint64_t at;
+  /** order of scheduling, so that timers due at once fire first come first */
+  uint64_t seq;
+  TimerHandler fire;
+  void *ctx;
+} Timer;
+
+/** pending timers as a min-heap on (at, seq) */
+typedef struct Timers {
+  Timer *heap;
+  size_t len;
+  size_t cap;
+  uint64_t seq;
+} Timers;
+
+struct VM {
+  unsigned char *memory;
+  int memory_len;
+  unsigned char *ip;
+  unsigned char *end;
+  /** predecoded instructions, indexed by offset into memory */
+  Decoded *code;
+  /** basic blocks, indexed by offset into memory */
+  Block *blocks;
+  /**
+   * LEADER_JUMP for offsets that are the target of (or follow) a jump,
+   * LEADER_BREAKPOINT for breakpoints, so that blocks start at breakpoints
+   */
+  uint8_t *leaders;
+  /** registers8 aliases registers as bytes: al, ah, bl, bh, ... */
+  union {
+    uint16_t registers[9];
+    uint8_t registers8[18];
+  };
+  uint16_t flags;
+  /**
+   * Per page PAGE_COW to save the page into `snapshot` before it is next
+   * written, PAGE_WATCHED if a watch lies in it, PAGE_ROM or PAGE_MMIO for
+   * pages that are not RAM, PAGE_CODE for the pages of the program. All
+   * zero elsewhere without snapshots, watches and devices, so loads and
+   * stores only pay for a well-predicted check.
+   */
+  uint8_t page_traps[N_PAGES];
+  /**
+   * Whether the program has been stored into since it was last decoded, and
+   * the bytes stored over: the run loops decode them again after the store
+   */
+  int code_stored;
+  uint32_t code_lo;
+  uint32_t code_hi;
+  /** the devices of PAGE_MMIO pages */
+  MmioHandler mmio[N_PAGES];
+  Snapshot *snapshot;
+  /** estimated clocks spent so far */
+  uint64_t clocks;
+  /** instructions retired so far */
+  uint64_t instrs;
+  /**
+   * Instruction count at which the run loops stop for handle_deadline. The
+   * loops compare against it once per block (or instruction), so all events
+   * that must interrupt a run share this one check; other threads and signal
+   * handlers set it to 0 to get attention at the next block.
+   */
+  _Atomic uint64_t deadline;
+  /** interrupt requested by the host: vector + 1, or 0 */
+  _Atomic int irq;
+  /** set by cancel_run from other threads */
+  _Atomic int cancel;
+  Journal journal;
+  /** budget: instruction count and clocks to stop running at */
+  uint64_t stop_at;
+  uint64_t clock_limit;
+  /**
+   * The deadline in clocks: the earlier of clock_limit and the next timer.
+   * Like `deadline` it is compared against once per block, and blocks that
+   * would run past it are cut short, so timers fire at the first
+   * instruction boundary at or after their clock.
+   */
+  uint64_t clock_deadline;
+  Timeline timeline;
+  /** why the last run stopped, and a stop to make at the next check */
+  StopReason stopped;
+  StopReason pending_stop;
+  /**
+   * Instruction count of the breakpoint just stopped at: it is passed over
+   * when running on from there
+   */
+  uint64_t resume_instrs;
+  /** block of the breakpoint being stopped at or resumed from */
+  Block break_block;
+  Watch *watches;
+  int n_watches;
+  /** the last watch hit: store address and the old byte there */
+  uint32_t watch_addr;
+  uint8_t watch_old;
+  /** what the guest waits for since it yielded, and the port of an IN */
+  WaitKind wait;
+  uint16_t wait_port;
+  /** the value the host completed the wait for an IN with */
+  int in_ready;
+  uint16_t in_value;
+  /**
+   * Handlers of all 64K ports, so that IN and OUT call them without a
+   * lookup. NULL until one is set: IN and OUT yield to the host then.
+   */
+  PortHandler *ports;
+  /** the handler of the ports no handler was set for */
+  PortHandler default_port;
+  /** host handlers per interrupt vector; NULL for the guest's handler */
+  InterruptHandler interrupts[256];
+  void *interrupt_ctx[256];
+  /** address of the interrupt vector table: 256 far pointers */
+  uint16_t vector_table;
+  Timers timers;
+  Cpu cpu;
+  Biu biu;
+  /** flat array indexed by ip offset into memory, NULL when not profiling */
+  ProfileEntry *profile;
+  Sampler sampler;
+  CallPaths callpaths;
+  int trace;
+  /** print the clock estimate in the trace */
+  int show_clocks;
+  InstrHook hook;
+  void *hook_ctx;
+  InstrFilter filter;
+  /** private mapping of the image the VM was loaded from, if any */
+  void *image;
+  size_t image_len;
+  /** memory was allocated by vm_create and is freed with the VM */
+  int owns_memory;
+};
+
+/** ports without a device: reads see the bus float high, writes are lost */
+static uint16_t open_bus_in(VM *vm, uint16_t port, int wide, void *ctx) {
+  (void)vm;
+  (void)port;
+  (void)ctx;
+  return wide ? 0xFFFF : 0xFF;
+}
+
+static void ignore_out(VM *vm, uint16_t port, uint16_t value, int wide,
+                       void *ctx) {
+  (void)vm;
+  (void)port;
+  (void)value;
+  (void)wide;
+  (void)ctx;
+}
+
+static VM new_vm(unsigned char *memory, int memory_len) {
+  VM vm = {.memory = memory,
+           .memory_len = memory_len,
+           .ip = memory,
+           .end = memory + memory_len,
+           .code = NULL,
+           .blocks = NULL,
+           .leaders = NULL,
+           .registers = {0, 0, 0, 0, 0, 0, 0, 0, 0},
+           .flags = 0,
+           .page_traps = {0},
+           .mmio = {{NULL}},
+           .snapshot = NULL,
+           .clocks = 0,
+           .instrs = 0,
+           .deadline = UINT64_MAX,
+           .irq = 0,
+           .cancel = 0,
+           .journal = {.mode = JOURNAL_OFF},
+           .stop_at = UINT64_MAX,
+           .clock_limit = UINT64_MAX,
+           .clock_deadline = UINT64_MAX,
+           .timeline = {.interval = 0},
+           .stopped = STOP_NONE,
+           .pending_stop = STOP_NONE,
+           .resume_instrs = UINT64_MAX,
+           .break_block = {0},
+           .watches = NULL,
+           .n_watches = 0,
+           .wait = WAIT_NONE,
+           .in_ready = 0,
+           .ports = NULL,
+           .default_port = {open_bus_in, ignore_out, NULL},
+           .interrupts = {NULL},
+           .vector_table = 0,
+           .timers = {.heap = NULL},
+           .cpu = CPU_8086,
+           .biu = {.enabled = 0},
+           .profile = NULL,
+           .sampler = {.period = 0},
+           .callpaths = {.nodes = NULL},
+           .trace = 0,
+           .show_clocks = 0,
+           .hook = NULL,
+           .hook_ctx = NULL,
+           .filter = NULL,
+           .image = NULL,
+           .image_len = 0,
+           .owns_memory = 0};
+
+  return vm;
+}
+
+static size_t reg_to_index(Reg r) {
+  switch (r) {
+  case AX:
+    return 0;
+  case BX:
+    return 1;
+  case CX:
+    return 2;
+  case DX:
+    return 3;
+  case SP:
+    return 4;
+  case BP:
+    return 5;
+  case SI:
+    return 6;
+  case DI:
+    return 7;
+  default:
+    return 0;
+  }
+}
+
+/** index into registers8; assumes a little-endian host */
+static size_t reg8_to_index(Reg r) {
+  switch (r) {
+  case AL:
+    return 0;
+  case AH:
+    return 1;
+  case BL:
+    return 2;
+  case BH:
+    return 3;
+  case CL:
+    return 4;
+  case CH:
+    return 5;
+  case DL:
+    return 6;
+  case DH:
+    return 7;
+  default:
+    return 0;
+  }
+}
+
+static int is_wide_reg(Reg r) {
+  switch (r) {
+  case AX:
+  case BX:
+  case CX:
+  case DX:
+  case SP:
+  case BP:
+  case SI:
+  case DI:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+void print_reg_by_idx(size_t index) {
+  if (index == 0)
+    printf("ax");
+  if (index == 1)
+    printf("bx");
+  if (index == 2)
+    printf("cx");
+  if (index == 3)
+    printf("dx");
+  if (index == 4)
+    printf("sp");
+  if (index == 5)
+    printf("bp");
+  if (index == 6)
+    printf("si");
+  if (index == 7)
+    printf("di");
+}
+
+void dump_registers(VM *vm) {
+  for (int i = 0; i < 8; i++) {
+    print_reg_by_idx(i);
+    printf(": %x (%d); ", vm->registers[i], vm->registers[i]);
+  }
+  printf("\n");
+  printf("ip: %p\n", vm->ip);
+}
+
+/** PF (flag bit 2) is set when the low byte of the result has even parity */
+static inline void update_pf(VM *vm, uint8_t arithm_result) {
+  if (__builtin_parity(arithm_result)) {
+    vm->flags &= ~(1 << 2);
+  } else {
+    vm->flags |= 1 << 2;
+  }
+}
+
+/** CF and OF, which the group below sets (MUL and IMUL to the same value) */
+static inline void set_cf_of(VM *vm, int cf, int of) {
+  vm->flags = (vm->flags & ~(1 | 1 << 11)) | cf | of << 11;
+}
+
+static void update_flags16(VM *vm, uint16_t arithm_result) {
+  if (arithm_result == 0) {
+    vm->flags |= (1 << 6);
+  } else {
+    vm->flags &= ~(1 << 6);
+  }
+
+  // highest bit set? then set SF
+  if (arithm_result & (1 << 15)) {
+    vm->flags |= (1 << 7);
+  } else {
+    vm->flags &= ~(1 << 7);
+  }
+  update_pf(vm, arithm_result);
+}
+
+static void update_flags8(VM *vm, uint8_t arithm_result) {
+  if (arithm_result == 0) {
+    vm->flags |= (1 << 6);
+  } else {
+    vm->flags &= ~(1 << 6);
+  }
+
+  if (arithm_result & (1 << 7)) {
+    vm->flags |= (1 << 7);
+  } else {
+    vm->flags &= ~(1 << 7);
+  }
+  update_pf(vm, arithm_result);
+}
+
+void dump_flags(VM *vm) {
+  printf("flags: \nSF: %d, ZF: %d\n", (vm->flags >> 7) & 1,
+         (vm->flags >> 6) & 1);
+}
+
+void dump_clocks(VM *vm) {
+  printf("clocks: %" PRIu64 " (%s)\n", vm->clocks,
+         vm->cpu == CPU_8088 ? "8088" : "8086");
+  if (vm->biu.enabled) {
+    printf("clocks with prefetch queue: %" PRIu64 " (%" PRIu64 " stalled)\n",
+           vm->clocks + vm->biu.stalls, vm->biu.stalls);
+  }
+}
+
+static inline uint16_t effective_addr(VM *vm, Decoded *d) {
+  return vm->registers[d->ea_base] + vm->registers[d->ea_index] + d->disp;
+}
+
+/** extra clocks for one word transfer at addr on the selected bus */
+static inline void charge_word_transfer(VM *vm, uint16_t addr) {
+  vm->clocks += ((addr | vm->cpu) & 1) * 4;
+}
+
+/** saves a page into the snapshot ahead of its first write since then */
+static void cow_fault(VM *vm, uint32_t page) {
+  Snapshot *s = vm->snapshot;
+  memcpy(s->pages + page * PAGE_SIZE, vm->memory + page * PAGE_SIZE,
+         PAGE_SIZE);
+  s->saved[s->n_saved++] = page;
+  vm->page_traps[page] &= ~PAGE_COW;
+}
+
+/** makes the run loops stop at their next check of the deadline */
+static inline void stop_soon(VM *vm, StopReason reason) {
+  if (!vm->pending_stop) {
+    vm->pending_stop = reason;
+  }
+  atomic_store_explicit(&vm->deadline, 0, memory_order_relaxed);
+}
+
+static uint8_t mmio_read(VM *vm, uint32_t addr);
+
+/** records a store that changes the program at addr */
+static void note_code_store(VM *vm, uint32_t addr) {
+  if (!vm->code_stored) {
+    vm->code_stored = 1;
+    vm->code_lo = addr;
+    vm->code_hi = addr;
+  } else if (addr < vm->code_lo) {
+    vm->code_lo = addr;
+  } else if (addr > vm->code_hi) {
+    vm->code_hi = addr;
+  }
+}
+
+/** the slow path of a store; nonzero when it does not go to memory */
+static int page_trap(VM *vm, uint32_t addr, uint8_t value) {
+  uint32_t page = addr >> PAGE_SHIFT;
+  if (vm->page_traps[page] & PAGE_WATCHED) {
+    for (int i = 0; i < vm->n_watches; i++) {
+      Watch *w = &vm->watches[i];
+      if (addr - w->addr < w->len && !vm->pending_stop) {
+        vm->watch_addr = addr;
+        vm->watch_old = vm->memory[addr];
+        stop_soon(vm, STOP_WATCHPOINT);
+        break;
+      }
+    }
+  }
+  if (vm->page_traps[page] & PAGE_MMIO) {
+    MmioHandler *h = &vm->mmio[page];
+    h->write(vm, addr, value, h->ctx);
+    return 1;
+  }
+  if (vm->page_traps[page] & PAGE_ROM) {
+    return 1;
+  }
+  if (vm->page_traps[page] & PAGE_COW) {
+    cow_fault(vm, page);
+  }
+  if (vm->page_traps[page] & PAGE_CODE && addr < (uint32_t)vm->memory_len &&
+      vm->memory[addr] != value) {
+    note_code_store(vm, addr);
+  }
+  return 0;
+}
+
+/** sets or clears a trap bit on every page */
+static void set_page_traps(VM *vm, uint8_t trap, int on) {
+  for (int page = 0; page < N_PAGES; page++) {
+    if (on) {
+      vm->page_traps[page] |= trap;
+    } else {
+      vm->page_traps[page] &= ~trap;
+    }
+  }
+}
+
+static inline void write_mem8(VM *vm, uint32_t addr, uint8_t value) {
+  if (__builtin_expect(vm->page_traps[addr >> PAGE_SHIFT], 0) &&
+      page_trap(vm, addr, value)) {
+    return;
+  }
+  vm->memory[addr] = value;
+}
+
+static inline uint8_t read_mem8(VM *vm, uint32_t addr) {
+  if (__builtin_expect(vm->page_traps[addr >> PAGE_SHIFT] & PAGE_MMIO, 0)) {
+    return mmio_read(vm, addr);
+  }
+  return vm->memory[addr];
+}
+
+static inline uint16_t read_mem16(VM *vm, uint16_t addr) {
+  charge_word_transfer(vm, addr);
+  uint32_t next = addr + 1;
+  if (__builtin_expect((vm->page_traps[addr >> PAGE_SHIFT] |
+                        vm->page_traps[next >> PAGE_SHIFT]) &
+                           PAGE_MMIO,
+                       0)) {
+    return mmio_read(vm, addr) | (mmio_read(vm, next) << 8);
+  }
+  return vm->memory[addr] | (vm->memory[next] << 8);
+}
+
+static inline void write_mem16(VM *vm, uint16_t addr, uint16_t value) {
+  charge_word_transfer(vm, addr);
+  write_mem8(vm, addr, value & 0xFF);
+  write_mem8(vm, addr + 1, value >> 8);
+}
+
+/**
+ * Operand accessors used to stamp out the handlers below; `ea` is the
+ * effective address computed at the top of every handler (and dropped by the
+ * compiler when the shape has no memory operand).
+ */
+#define LOAD_r16(slot) vm->registers[d->slot]
+#define LOAD_r8(slot) vm->registers8[d->slot]
+#define LOAD_mem16(slot) read_mem16(vm, ea)
+#define LOAD_mem8(slot) read_mem8(vm, ea)
+#define LOAD_imm(slot) d->imm
+
+#define STORE_r16(v) vm->registers[d->dst] = (v)
+#define STORE_r8(v) vm->registers8[d->dst] = (v)
+#define STORE_mem16(v) write_mem16(vm, ea, (v))
+#define STORE_mem8(v) write_mem8(vm, ea, (v))
+
+#define mov_BODY(dk, sk, bits) STORE_##dk(LOAD_##sk(src));
+
+/**
+ * CF is the carry or borrow out of the top bit; OF is set when the operands
+ * of an ADD have the same sign and the result doesn't, or when those of a
+ * SUB differ in sign and the result has the subtrahend's
+ */
+#define add_BODY(dk, sk, bits)                                                 \
+  uint##bits##_t a = LOAD_##dk(dst), b = LOAD_##sk(src);                       \
+  uint##bits##_t result = a + b;                                               \
+  STORE_##dk(result);                                                          \
+  set_cf_of(vm, result < a, ((a ^ result) & (b ^ result)) >> (bits - 1));     \
+  update_flags##bits(vm, result);
+
+#define sub_BODY(dk, sk, bits)                                                 \
+  uint##bits##_t a = LOAD_##dk(dst), b = LOAD_##sk(src);                       \
+  uint##bits##_t result = a - b;                                               \
+  STORE_##dk(result);                                                          \
+  set_cf_of(vm, a < b, ((a ^ b) & (a ^ result)) >> (bits - 1));               \
+  update_flags##bits(vm, result);
+
+#define cmp_BODY(dk, sk, bits)                                                 \
+  uint##bits##_t a = LOAD_##dk(dst), b = LOAD_##sk(src);                       \
+  uint##bits##_t result = a - b;                                               \
+  set_cf_of(vm, a < b, ((a ^ b) & (a ^ result)) >> (bits - 1));               \
+  update_flags##bits(vm, result);
+
+#define DEFINE_HANDLER(op, dk, sk, bits)                                       \
+  static void op##_##dk##_##sk(VM *vm, Decoded *d) {                           \
+    uint16_t ea = effective_addr(vm, d);                                       \
+    (void)ea;                                                                  \
+    op##_BODY(dk, sk, bits)                                                    \
+  }
+
+/** operand shapes, in the order of the rows of alu_handlers */
+typedef enum Shape {
+  R16_R16,
+  R16_IMM,
+  R16_MEM16,
+  MEM16_R16,
+  MEM16_IMM,
+  R8_R8,
+  R8_IMM,
+  R8_MEM8,
+  MEM8_R8,
+  MEM8_IMM,
+  N_SHAPES,
+} Shape;
+
+#define DEFINE_HANDLERS(op)                                                    \
+  DEFINE_HANDLER(op, r16, r16, 16)                                             \
+  DEFINE_HANDLER(op, r16, imm, 16)                                             \
+  DEFINE_HANDLER(op, r16, mem16, 16)                                           \
+  DEFINE_HANDLER(op, mem16, r16, 16)                                           \
+  DEFINE_HANDLER(op, mem16, imm, 16)                                           \
+  DEFINE_HANDLER(op, r8, r8, 8)                                                \
+  DEFINE_HANDLER(op, r8, imm, 8)                                               \
+  DEFINE_HANDLER(op, r8, mem8, 8)                                              \
+  DEFINE_HANDLER(op, mem8, r8, 8)                                              \
+  DEFINE_HANDLER(op, mem8, imm, 8)
+
+#define HANDLER_ROW(op)                                                        \
+  {op##_r16_r16, op##_r16_imm, op##_r16_mem16, op##_mem16_r16, op##_mem16_imm, \
+   op##_r8_r8,   op##_r8_imm,  op##_r8_mem8,   op##_mem8_r8,   op##_mem8_imm}
+
+DEFINE_HANDLERS(mov)
+DEFINE_HANDLERS(add)
+DEFINE_HANDLERS(sub)
+DEFINE_HANDLERS(cmp)
+
+/** indexed by Op (MOV, ADD, SUB, CMP) and Shape */
+static const Handler alu_handlers[4][N_SHAPES] = {
+    HANDLER_ROW(mov), HANDLER_ROW(add), HANDLER_ROW(sub), HANDLER_ROW(cmp)};
+
+/**
+ * Stops at instruction d without retiring it, so that it runs again when
+ * the run is resumed. d ends its block (see build_block), so nothing after
+ * it has run.
+ */
+static void stop_before(VM *vm, Decoded *d, StopReason reason) {
+  vm->ip = vm->memory + (d - vm->code);
+  vm->instrs--;
+  vm->clocks -= d->clocks;
+  stop_soon(vm, reason);
+}
+
+static void fault(VM *vm, Decoded *d) { stop_before(vm, d, STOP_FAULT); }
+
+/**
+ * Jumping to the end of the program ends it, past it is a fault. Which of
+ * the two a jump does is known at decode time, so each gets its handler:
+ * exec_<name> and exec_<name>_out. `step` is what the jump does besides
+ * jumping, done unless it faults.
+ */
+#define DEFINE_JUMP(name, taken, step)                                        \
+  static void exec_##name(VM *vm, Decoded *d) {                               \
+    int jump = taken;                                                          \
+    step;                                                                      \
+    if (jump) {                                                                \
+      vm->ip = vm->memory + d->target;                                         \
+      vm->clocks += d->taken_clocks;                                           \
+    }                                                                          \
+  }                                                                            \
+  static void exec_##name##_out(VM *vm, Decoded *d) {                         \
+    if (taken) {                                                               \
+      fault(vm, d);                                                            \
+      return;                                                                  \
+    }                                                                          \
+    step;                                                                      \
+  }
+
+/** on CF (flag bit 0), PF (2), ZF (6), SF (7) and OF (11) */
+DEFINE_JUMP(je, vm->flags >> 6 & 1, (void)0)
+DEFINE_JUMP(jne, !(vm->flags >> 6 & 1), (void)0)
+DEFINE_JUMP(js, vm->flags >> 7 & 1, (void)0)
+DEFINE_JUMP(jns, !(vm->flags >> 7 & 1), (void)0)
+DEFINE_JUMP(jb, vm->flags & 1, (void)0)
+DEFINE_JUMP(jnb, !(vm->flags & 1), (void)0)
+DEFINE_JUMP(jbe, (vm->flags | vm->flags >> 6) & 1, (void)0)
+DEFINE_JUMP(jnbe, !((vm->flags | vm->flags >> 6) & 1), (void)0)
+DEFINE_JUMP(jp, vm->flags >> 2 & 1, (void)0)
+DEFINE_JUMP(jnp, !(vm->flags >> 2 & 1), (void)0)
+DEFINE_JUMP(jo, vm->flags >> 11 & 1, (void)0)
+DEFINE_JUMP(jno, !(vm->flags >> 11 & 1), (void)0)
+
+/** signed comparisons: less is SF != OF */
+DEFINE_JUMP(jl, (vm->flags >> 7 ^ vm->flags >> 11) & 1, (void)0)
+DEFINE_JUMP(jnl, !((vm->flags >> 7 ^ vm->flags >> 11) & 1), (void)0)
+DEFINE_JUMP(jle, ((vm->flags >> 7 ^ vm->flags >> 11) | vm->flags >> 6) & 1,
+            (void)0)
+DEFINE_JUMP(jnle,
+            !(((vm->flags >> 7 ^ vm->flags >> 11) | vm->flags >> 6) & 1),
+            (void)0)
+
+/** LOOP, LOOPZ and LOOPNZ decrement cx and jump while it isn't 0 yet */
+DEFINE_JUMP(loop, vm->registers[2] != 1, vm->registers[2]--)
+DEFINE_JUMP(loopz, vm->registers[2] != 1 && vm->flags >> 6 & 1,
+            vm->registers[2]--)
+DEFINE_JUMP(loopnz, vm->registers[2] != 1 && !(vm->flags >> 6 & 1),
+            vm->registers[2]--)
+DEFINE_JUMP(jcxz, vm->registers[2] == 0, (void)0)
+
+/** indexed by Op and whether the target lies past the program */
+static const Handler jump_handlers[UNKNOWN_OP][2] = {
+    [JE] = {exec_je, exec_je_out},
+    [JNE] = {exec_jne, exec_jne_out},
+    [JS] = {exec_js, exec_js_out},
+    [JNS] = {exec_jns, exec_jns_out},
+    [JL] = {exec_jl, exec_jl_out},
+    [JNL] = {exec_jnl, exec_jnl_out},
+    [JLE] = {exec_jle, exec_jle_out},
+    [JNLE] = {exec_jnle, exec_jnle_out},
+    [JB] = {exec_jb, exec_jb_out},
+    [JNB] = {exec_jnb, exec_jnb_out},
+    [JBE] = {exec_jbe, exec_jbe_out},
+    [JNBE] = {exec_jnbe, exec_jnbe_out},
+    [JP] = {exec_jp, exec_jp_out},
+    [JNP] = {exec_jnp, exec_jnp_out},
+    [JO] = {exec_jo, exec_jo_out},
+    [JNO] = {exec_jno, exec_jno_out},
+    [LOOP] = {exec_loop, exec_loop_out},
+    [LOOPZ] = {exec_loopz, exec_loopz_out},
+    [LOOPNZ] = {exec_loopnz, exec_loopnz_out},
+    [JCXZ] = {exec_jcxz, exec_jcxz_out},
+};
+
+/** not (yet) simulated, or rejected by the InstrFilter: only advances ip */
+static void exec_nop(VM *vm, Decoded *d) {
+  (void)vm;
+  (void)d;
+}
+
+static void exec_unknown(VM *vm, Decoded *d) { fault(vm, d); }
+
+static int port_in(VM *vm, Decoded *d, uint16_t port, uint16_t *value);
+
+/**
+ * IN and OUT: the port is effective_addr, i.e. dx or the immediate port in
+ * disp. The port's handler is called straight from the table. A handler
+ * can stop or yield the run, so port instructions end their block.
+ */
+static void exec_in(VM *vm, Decoded *d) {
+  uint16_t port = effective_addr(vm, d);
+  uint16_t value;
+  if (vm->ports && vm->journal.mode == JOURNAL_OFF &&
+      !vm->timeline.history.f) {
+    PortHandler *h = &vm->ports[port];
+    value = h->in(vm, port, d->instr.wide, h->ctx);
+  } else if (port_in(vm, d, port, &value)) {
+    return;
+  }
+  if (d->instr.wide) {
+    charge_word_transfer(vm, port);
+    vm->registers[0] = value;
+  } else {
+    vm->registers8[0] = value;
+  }
+}
+
+static void exec_out(VM *vm, Decoded *d) {
+  uint16_t port = effective_addr(vm, d);
+  uint16_t value = d->instr.wide ? vm->registers[0] : vm->registers8[0];
+  if (d->instr.wide) {
+    charge_word_transfer(vm, port);
+  }
+  if (vm->ports) {
+    PortHandler *h = &vm->ports[port];
+    h->out(vm, port, value, d->instr.wide, h->ctx);
+  } else {
+    vm->wait = WAIT_PORT_OUT;
+    vm->wait_port = port;
+    stop_soon(vm, STOP_YIELD);
+  }
+}
+
+/** stack operations at ss:sp; ss is 0, like the other segments */
+static inline void push16(VM *vm, uint16_t value) {
+  vm->registers[4] -= 2;
+  write_mem16(vm, vm->registers[4], value);
+}
+
+static inline uint16_t pop16(VM *vm) {
+  uint16_t value = read_mem16(vm, vm->registers[4]);
+  vm->registers[4] += 2;
+  return value;
+}
+
+/**
+ * Enters the handler of an interrupt: the host's if one is set for the
+ * vector, else the guest's, as on the 8086: flags, cs and ip are pushed, IF
+ * and TF cleared, and cs:ip loaded from the vector table. Returns nonzero,
+ * changing nothing, if the guest's handler lies outside the program.
+ */
+static int enter_interrupt(VM *vm, uint8_t vector) {
+  if (vm->interrupts[vector]) {
+    vm->interrupts[vector](vm, vector, vm->interrupt_ctx[vector]);
+    return 0;
+  }
+  uint16_t entry = vm->vector_table + vector * 4;
+  uint32_t target = read_mem16(vm, entry + 2) * 16 + read_mem16(vm, entry);
+  if (target >= (uint32_t)vm->memory_len) {
+    return 1;
+  }
+  /** ip is an offset into all of memory: split it into cs:ip */
+  size_t offset = vm->ip - vm->memory;
+  uint16_t cs = offset >> 4 & 0xF000;
+  push16(vm, vm->flags);
+  push16(vm, cs);
+  push16(vm, offset - cs * 16);
+  vm->flags &= ~0x300;
+  vm->ip = vm->memory + target;
+  return 0;
+}
+
+/**
+ * IF (flag bit 9) masks the interrupts requested by the host: one raised
+ * while it is clear stays pending, and is taken at the next block once the
+ * guest sets IF again
+ */
+static void unmask_irq(VM *vm) {
+  if (vm->flags & 1 << 9 && atomic_load(&vm->irq)) {
+    atomic_store(&vm->deadline, 0);
+  }
+}
+
+static void exec_int(VM *vm, Decoded *d) {
+  if (enter_interrupt(vm, d->imm)) {
+    fault(vm, d);
+  }
+}
+
+static void exec_iret(VM *vm, Decoded *d) {
+  uint16_t sp = vm->registers[4];
+  uint32_t target = read_mem16(vm, sp + 2) * 16 + read_mem16(vm, sp);
+  if (target > (uint32_t)vm->memory_len) {
+    fault(vm, d);
+    return;
+  }
+  vm->ip = vm->memory + target;
+  vm->flags = read_mem16(vm, sp + 4);
+  vm->registers[4] = sp + 6;
+  unmask_irq(vm);
+}
+
+/** PUSH SP pushes the value after the decrement, as on the 8086 */
+static void exec_push_r16(VM *vm, Decoded *d) {
+  uint16_t sp = vm->registers[4] -= 2;
+  write_mem16(vm, sp, vm->registers[d->src]);
+}
+
+static void exec_push_mem16(VM *vm, Decoded *d) {
+  push16(vm, read_mem16(vm, effective_addr(vm, d)));
+}
+
+static void exec_pop_r16(VM *vm, Decoded *d) {
+  vm->registers[d->dst] = pop16(vm);
+}
+
+static void exec_pop_mem16(VM *vm, Decoded *d) {
+  uint16_t value = pop16(vm);
+  write_mem16(vm, effective_addr(vm, d), value);
+}
+
+static void shadow_call(VM *vm, uint32_t entry, uint32_t ret);
+static void shadow_ret(VM *vm, uint32_t target);
+
+/**
+ * Near CALL and RET: the return address is the offset of the next
+ * instruction in cs, split off ip like enter_interrupt does. Calling to the
+ * end of the program ends it, like a jump; past it is a fault (decode_at
+ * gives those calls the fault handler).
+ */
+static void exec_call(VM *vm, Decoded *d) {
+  size_t next = vm->ip - vm->memory;
+  uint16_t cs = next >> 4 & 0xF000;
+  push16(vm, next - cs * 16);
+  vm->ip = vm->memory + d->target;
+  if (vm->callpaths.nodes) {
+    shadow_call(vm, d->target, next);
+  }
+}
+
+/** RET, and RET n that drops n bytes of arguments off the stack too */
+static void exec_ret(VM *vm, Decoded *d) {
+  uint16_t cs = (vm->ip - vm->memory) >> 4 & 0xF000;
+  uint16_t sp = vm->registers[4];
+  uint32_t target = cs * 16 + read_mem16(vm, sp);
+  if (target > (uint32_t)vm->memory_len) {
+    fault(vm, d);
+    return;
+  }
+  vm->registers[4] = sp + 2 + d->imm;
+  vm->ip = vm->memory + target;
+  if (vm->callpaths.nodes) {
+    shadow_ret(vm, target);
+  }
+}
+
+/** 8086 clocks of string instructions: {alone, per REP iteration} */
+static const uint8_t string_clocks[UNKNOWN_OP][2] = {
+    [MOVS] = {18, 17}, [CMPS] = {22, 22}, [STOS] = {11, 10},
+    [LODS] = {12, 13}, [SCAS] = {15, 15},
+};
+
+/**
+ * String instructions run over si (source) and di (destination), which
+ * step by the element size, down when DF is set. ds and es are 0, like the
+ * other segments. With a REP prefix one instruction runs cx iterations;
+ * decode_at charges the 9 clocks of the prefix and the handlers charge the
+ * iterations, so the estimate stays the 8086's however they are run.
+ */
+static inline int string_step(VM *vm, Decoded *d) {
+  int size = d->instr.wide + 1;
+  return vm->flags & (1 << 10) ? -size : size;
+}
+
+static inline uint32_t string_count(VM *vm, Decoded *d) {
+  return d->instr.op_data.string.rep ? vm->registers[2] : 1;
+}
+
+/**
+ * The lowest address of n elements from addr on, or -1 if they wrap around
+ * the end of the segment
+ */
+static long string_span(uint16_t addr, uint32_t n, int step) {
+  long low = step < 0 ? (long)addr + (long)(n - 1) * step : addr;
+  return low < 0 || low + n * abs(step) > 0x10000 ? -1 : low;
+}
+
+/**
+ * Readies [addr, addr + len) for stores that bypass write_mem8 by saving
+ * its copy-on-write pages. Returns 0, saving nothing, if a page is watched,
+ * ROM, MMIO or code: stores there are made one at a time.
+ */
+static int bulk_store(VM *vm, long addr, uint32_t len) {
+  if (addr < 0) {
+    return 0;
+  }
+  uint32_t first = addr >> PAGE_SHIFT;
+  uint32_t last = (addr + len - 1) >> PAGE_SHIFT;
+  for (uint32_t page = first; page <= last; page++) {
+    if (vm->page_traps[page] & ~PAGE_COW) {
+      return 0;
+    }
+  }
+  for (uint32_t page = first; page <= last; page++) {
+    if (vm->page_traps[page] & PAGE_COW) {
+      cow_fault(vm, page);
+    }
+  }
+  return 1;
+}
+
+/** whether [addr, addr + len) can be read bypassing read_mem8: no MMIO */
+static int bulk_load(VM *vm, long addr, uint32_t len) {
+  if (addr < 0) {
+    return 0;
+  }
+  for (uint32_t page = addr >> PAGE_SHIFT;
+       page <= (addr + len - 1) >> PAGE_SHIFT; page++) {
+    if (vm->page_traps[page] & PAGE_MMIO) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** word penalties of n transfers at addr: the parity never changes */
+static inline void charge_word_transfers(VM *vm, uint16_t addr, uint32_t n) {
+  vm->clocks += ((addr | vm->cpu) & 1) * 4 * (uint64_t)n;
+}
+
+static inline uint16_t string_load(VM *vm, Decoded *d, uint16_t addr) {
+  return d->instr.wide ? read_mem16(vm, addr) : read_mem8(vm, addr);
+}
+
+static inline void string_store(VM *vm, Decoded *d, uint16_t addr,
+                                uint16_t value) {
+  if (d->instr.wide) {
+    write_mem16(vm, addr, value);
+  } else {
+    write_mem8(vm, addr, value);
+  }
+}
+
+/** the end of a string instruction that ran n iterations */
+static void string_done(VM *vm, Decoded *d, uint32_t n) {
+  if (d->instr.op_data.string.rep) {
+    vm->registers[2] -= n;
+    vm->clocks += n * string_clocks[d->instr.op_type][1];
+  }
+}
+
+/**
+ * REP MOVS copies with one memmove when it comes to the same as copying
+ * element by element: the copy does not overlap its source ahead of the
+ * reads (which 8086 code uses to replicate a pattern) and no page in
+ * either range needs its loads or stores one at a time.
+ */
+static void exec_movs(VM *vm, Decoded *d) {
+  uint32_t n = string_count(vm, d);
+  int step = string_step(vm, d);
+  uint16_t si = vm->registers[6];
+  uint16_t di = vm->registers[7];
+  uint32_t len = n * abs(step);
+  long src = string_span(si, n, step);
+  long dst = string_span(di, n, step);
+  int ahead = step > 0 ? dst > src && dst < src + len
+                       : dst < src && dst + len > src;
+
+  if (n > 1 && !ahead && bulk_load(vm, src, len) &&
+      bulk_store(vm, dst, len)) {
+    memmove(vm->memory + dst, vm->memory + src, len);
+    if (d->instr.wide) {
+      charge_word_transfers(vm, si, n);
+      charge_word_transfers(vm, di, n);
+    }
+  } else {
+    for (uint32_t k = 0; k < n; k++) {
+      string_store(vm, d, di + k * step, string_load(vm, d, si + k * step));
+    }
+  }
+  vm->registers[6] = si + n * step;
+  vm->registers[7] = di + n * step;
+  string_done(vm, d, n);
+}
+
+/** REP STOSB is a memset, REP STOSW a fill of the host's */
+static void exec_stos(VM *vm, Decoded *d) {
+  uint32_t n = string_count(vm, d);
+  int step = string_step(vm, d);
+  uint16_t di = vm->registers[7];
+  uint16_t value = d->instr.wide ? vm->registers[0] : vm->registers8[0];
+  uint32_t len = n * abs(step);
+  long dst = string_span(di, n, step);
+
+  if (n > 1 && bulk_store(vm, dst, len)) {
+    unsigned char *p = vm->memory + dst;
+    if (!d->instr.wide || (value & 0xFF) == value >> 8) {
+      memset(p, value & 0xFF, len);
+    } else {
+      for (uint32_t k = 0; k < len; k += 2) {
+        p[k] = value & 0xFF;
+        p[k + 1] = value >> 8;
+      }
+    }
+    if (d->instr.wide) {
+      charge_word_transfers(vm, di, n);
+    }
+  } else {
+    for (uint32_t k = 0; k < n; k++) {
+      string_store(vm, d, di + k * step, value);
+    }
+  }
+  vm->registers[7] = di + n * step;
+  string_done(vm, d, n);
+}
+
+/** REP LODS only keeps the last element it loads */
+static void exec_lods(VM *vm, Decoded *d) {
+  uint32_t n = string_count(vm, d);
+  int step = string_step(vm, d);
+  uint16_t si = vm->registers[6];
+  uint16_t value = d->instr.wide ? vm->registers[0] : vm->registers8[0];
+
+  if (n > 1 && bulk_load(vm, string_span(si, n, step), n * abs(step))) {
+    uint16_t last = si + (n - 1) * step;
+    value = string_load(vm, d, last);
+    if (d->instr.wide) {
+      charge_word_transfers(vm, si, n - 1);
+    }
+  } else {
+    for (uint32_t k = 0; k < n; k++) {
+      value = string_load(vm, d, si + k * step);
+    }
+  }
+  if (d->instr.wide) {
+    vm->registers[0] = value;
+  } else {
+    vm->registers8[0] = value;
+  }
+  vm->registers[6] = si + n * step;
+  string_done(vm, d, n);
+}
+
+/** whether REPE/REPNE go on after an iteration that left ZF so */
+static inline int string_repeats(VM *vm, Decoded *d) {
+  int zf = vm->flags >> 6 & 1;
+  return d->instr.op_data.string.rep == REPE ? zf : !zf;
+}
+
+static inline void string_compare(VM *vm, Decoded *d, uint16_t a,
+                                  uint16_t b) {
+  if (d->instr.wide) {
+    uint16_t r = a - b;
+    set_cf_of(vm, a < b, ((a ^ b) & (a ^ r)) >> 15);
+    update_flags16(vm, r);
+  } else {
+    uint8_t r = a - b;
+    set_cf_of(vm, (uint8_t)a < (uint8_t)b, ((a ^ b) & (a ^ r)) >> 7 & 1);
+    update_flags8(vm, r);
+  }
+}
+
+static void exec_cmps(VM *vm, Decoded *d) {
+  uint32_t n = string_count(vm, d);
+  int step = string_step(vm, d);
+  uint16_t si = vm->registers[6];
+  uint16_t di = vm->registers[7];
+  uint32_t k = 0;
+  while (k < n) {
+    uint16_t a = string_load(vm, d, si + k * step);
+    uint16_t b = string_load(vm, d, di + k * step);
+    string_compare(vm, d, a, b);
+    k++;
+    if (!string_repeats(vm, d)) {
+      break;
+    }
+  }
+  vm->registers[6] = si + k * step;
+  vm->registers[7] = di + k * step;
+  string_done(vm, d, k);
+}
+
+/** REPNE SCASB, the search for a byte, is a memchr */
+static void exec_scas(VM *vm, Decoded *d) {
+  uint32_t n = string_count(vm, d);
+  int step = string_step(vm, d);
+  uint16_t di = vm->registers[7];
+  uint16_t acc = d->instr.wide ? vm->registers[0] : vm->registers8[0];
+  uint32_t k = 0;
+
+  if (n > 1 && !d->instr.wide && step > 0 &&
+      d->instr.op_data.string.rep == REPNE &&
+      bulk_load(vm, string_span(di, n, step), n)) {
+    unsigned char *found = memchr(vm->memory + di, acc, n);
+    k = found ? (uint32_t)(found - (vm->memory + di)) + 1 : n;
+    string_compare(vm, d, acc, vm->memory[di + k - 1]);
+  } else {
+    while (k < n) {
+      string_compare(vm, d, acc, string_load(vm, d, di + k * step));
+      k++;
+      if (!string_repeats(vm, d)) {
+        break;
+      }
+    }
+  }
+  vm->registers[7] = di + k * step;
+  string_done(vm, d, k);
+}
+
+/** indexed by Op from MOVS on */
+static const Handler string_handlers[] = {exec_movs, exec_cmps, exec_stos,
+                                          exec_lods, exec_scas};
+
+static void exec_cld(VM *vm, Decoded *d) {
+  (void)d;
+  vm->flags &= ~(1 << 10);
+}
+
+static void exec_std(VM *vm, Decoded *d) {
+  (void)d;
+  vm->flags |= 1 << 10;
+}
+
+static void exec_cli(VM *vm, Decoded *d) {
+  (void)d;
+  vm->flags &= ~(1 << 9);
+}
+
+static void exec_sti(VM *vm, Decoded *d) {
+  (void)d;
+  vm->flags |= 1 << 9;
+  unmask_irq(vm);
+}
+
+/**
+ * 8086 clocks of MUL, IMUL, DIV and IDIV with a register operand: {min,
+ * max} for 8 and 16 bits. Memory operands take 6 more, plus the EA.
+ */
+static const uint8_t muldiv_clocks[4][2][2] = {
+    {{70, 77}, {118, 133}},
+    {{80, 98}, {128, 154}},
+    {{80, 90}, {144, 162}},
+    {{101, 112}, {165, 184}},
+};
+
+/**
+ * The operand-dependent part of the clocks of a multiply or divide: the
+ * microcode's add (or subtract) and shift loop takes longer the more 1
+ * bits of the multiplier (or quotient) it goes through, so the range is
+ * spread over the bits of x. decode_at has charged the minimum.
+ */
+static inline void charge_muldiv(VM *vm, Op op, int bits, uint16_t x) {
+  const uint8_t *range = muldiv_clocks[op - MUL][bits == 16];
+  vm->clocks += (range[1] - range[0]) * __builtin_popcount(x) / bits;
+}
+
+/**
+ * A quotient that does not fit: INT 0, which on the 8086 returns to the
+ * instruction after the division (DIV and IDIV end their block for it).
+ * The division is charged its minimum, the interrupt as INT n's 51 clocks.
+ */
+static void divide_error(VM *vm, Decoded *d) {
+  if (enter_interrupt(vm, 0)) {
+    fault(vm, d);
+    return;
+  }
+  vm->clocks += 51;
+}
+
+static inline void mul8(VM *vm, uint8_t value) {
+  uint16_t result = vm->registers8[0] * value;
+  vm->registers[0] = result;
+  set_cf_of(vm, result > 0xFF, result > 0xFF);
+  charge_muldiv(vm, MUL, 8, value);
+}
+
+static inline void mul16(VM *vm, uint16_t value) {
+  uint32_t result = (uint32_t)vm->registers[0] * value;
+  vm->registers[0] = result;
+  vm->registers[3] = result >> 16;
+  set_cf_of(vm, result > 0xFFFF, result > 0xFFFF);
+  charge_muldiv(vm, MUL, 16, value);
+}
+
+static inline void imul8(VM *vm, uint8_t value) {
+  int16_t result = (int8_t)vm->registers8[0] * (int8_t)value;
+  int wide = result != (int8_t)result;
+  vm->registers[0] = result;
+  set_cf_of(vm, wide, wide);
+  charge_muldiv(vm, IMUL, 8, abs((int8_t)value));
+}
+
+static inline void imul16(VM *vm, uint16_t value) {
+  int32_t result = (int16_t)vm->registers[0] * (int16_t)value;
+  int wide = result != (int16_t)result;
+  vm->registers[0] = result;
+  vm->registers[3] = (uint32_t)result >> 16;
+  set_cf_of(vm, wide, wide);
+  charge_muldiv(vm, IMUL, 16, abs((int16_t)value));
+}
+
+static inline void div8(VM *vm, Decoded *d, uint8_t value) {
+  uint16_t dividend = vm->registers[0];
+  if (value == 0 || dividend / value > 0xFF) {
+    divide_error(vm, d);
+    return;
+  }
+  vm->registers8[0] = dividend / value;
+  vm->registers8[1] = dividend % value;
+  charge_muldiv(vm, DIV, 8, vm->registers8[0]);
+}
+
+static inline void div16(VM *vm, Decoded *d, uint16_t value) {
+  uint32_t dividend = (uint32_t)vm->registers[3] << 16 | vm->registers[0];
+  if (value == 0 || dividend / value > 0xFFFF) {
+    divide_error(vm, d);
+    return;
+  }
+  vm->registers[0] = dividend / value;
+  vm->registers[3] = dividend % value;
+  charge_muldiv(vm, DIV, 16, vm->registers[0]);
+}
+
+/** the 8086 takes the most negative quotient for an overflow too */
+static inline void idiv8(VM *vm, Decoded *d, uint8_t value) {
+  int dividend = (int16_t)vm->registers[0];
+  int divisor = (int8_t)value;
+  if (divisor == 0 || dividend / divisor > 127 ||
+      dividend / divisor < -127) {
+    divide_error(vm, d);
+    return;
+  }
+  vm->registers8[0] = dividend / divisor;
+  vm->registers8[1] = dividend % divisor;
+  charge_muldiv(vm, IDIV, 8, abs(dividend / divisor));
+}
+
+static inline void idiv16(VM *vm, Decoded *d, uint16_t value) {
+  int64_t dividend =
+      (int32_t)((uint32_t)vm->registers[3] << 16 | vm->registers[0]);
+  int64_t divisor = (int16_t)value;
+  if (divisor == 0 || dividend / divisor > 32767 ||
+      dividend / divisor < -32767) {
+    divide_error(vm, d);
+    return;
+  }
+  vm->registers[0] = dividend / divisor;
+  vm->registers[3] = dividend % divisor;
+  charge_muldiv(vm, IDIV, 16, llabs(dividend / divisor));
+}
+
+/**
+ * Shifts and rotates of `bits` bit values by count, which the 8086 does
+ * not mask. Sets CF to the last bit shifted out and OF as for a count of
+ * 1; shifts also set ZF and SF. A count of 0 changes no flags.
+ */
+static inline uint16_t shift(VM *vm, Op op, uint32_t v, unsigned count,
+                             int bits) {
+  if (count == 0) {
+    return v;
+  }
+  uint32_t mask = (1u << bits) - 1;
+  uint32_t cf = vm->flags & 1;
+  uint32_t r;
+  switch (op) {
+  case ROL: {
+    unsigned c = count % bits;
+    r = ((v << c) | (v >> (bits - c))) & mask;
+    cf = r & 1;
+  } break;
+  case ROR: {
+    unsigned c = count % bits;
+    r = ((v >> c) | (v << (bits - c))) & mask;
+    cf = r >> (bits - 1);
+  } break;
+  case RCL: {
+    /** a rotate of bits + 1 bits, with CF on top */
+    unsigned c = count % (bits + 1);
+    uint32_t x = v | cf << bits;
+    x = ((x << c) | (x >> (bits + 1 - c))) & (mask << 1 | 1);
+    r = x & mask;
+    cf = x >> bits;
+  } break;
+  case RCR: {
+    unsigned c = count % (bits + 1);
+    uint32_t x = v | cf << bits;
+    x = ((x >> c) | (x << (bits + 1 - c))) & (mask << 1 | 1);
+    r = x & mask;
+    cf = x >> bits;
+  } break;
+  case SHL:
+    cf = count <= (unsigned)bits ? v >> (bits - count) & 1 : 0;
+    r = count < (unsigned)bits ? v << count & mask : 0;
+    break;
+  case SHR:
+    cf = count <= (unsigned)bits ? v >> (count - 1) & 1 : 0;
+    r = count < (unsigned)bits ? v >> count : 0;
+    break;
+  default: {
+    int32_t sv = v >> (bits - 1) ? (int32_t)(v | ~mask) : (int32_t)v;
+    unsigned c = count < (unsigned)bits ? count : (unsigned)bits;
+    cf = sv >> (c - 1) & 1;
+    r = (uint32_t)(sv >> (c < (unsigned)bits ? c : (unsigned)bits - 1)) & mask;
+  } break;
+  }
+
+  uint32_t msb = r >> (bits - 1);
+  int of;
+  if (op == ROL || op == RCL || op == SHL) {
+    of = msb ^ cf;
+  } else if (op == ROR || op == RCR) {
+    of = (msb ^ r >> (bits - 2)) & 1;
+  } else {
+    of = op == SHR ? v >> (bits - 1) : 0;
+  }
+  set_cf_of(vm, cf, of);
+  if (op >= SHL) {
+    if (bits == 16) {
+      update_flags16(vm, r);
+    } else {
+      update_flags8(vm, r);
+    }
+  }
+  return r;
+}
+
+/** 1, or cl at 4 clocks per bit */
+static inline unsigned shift_count(VM *vm, Decoded *d) {
+  if (d->imm) {
+    return 1;
+  }
+  vm->clocks += 4 * vm->registers8[4];
+  return vm->registers8[4];
+}
+
+/**
+ * Handlers of the F6/F7 and D0-D3 groups, stamped out per operand kind like
+ * the ALU handlers; the operand is in dst, TEST's immediate in imm
+ */
+#define test_BODY(k, bits)                                                     \
+  uint##bits##_t result = LOAD_##k(dst) & d->imm;                              \
+  set_cf_of(vm, 0, 0);                                                         \
+  update_flags##bits(vm, result);
+
+#define not_BODY(k, bits) STORE_##k(~LOAD_##k(dst));
+
+#define neg_BODY(k, bits)                                                      \
+  uint##bits##_t value = LOAD_##k(dst);                                        \
+  uint##bits##_t result = -value;                                              \
+  STORE_##k(result);                                                           \
+  set_cf_of(vm, value != 0, value != 0 && value == result);                    \
+  update_flags##bits(vm, result);
+
+#define mul_BODY(k, bits) mul##bits(vm, LOAD_##k(dst));
+#define imul_BODY(k, bits) imul##bits(vm, LOAD_##k(dst));
+#define div_BODY(k, bits) div##bits(vm, d, LOAD_##k(dst));
+#define idiv_BODY(k, bits) idiv##bits(vm, d, LOAD_##k(dst));
+
+#define SHIFT_BODY(op, k, bits)                                                \
+  unsigned count = shift_count(vm, d);                                         \
+  STORE_##k(shift(vm, op, LOAD_##k(dst), count, bits));
+
+#define rol_BODY(k, bits) SHIFT_BODY(ROL, k, bits)
+#define ror_BODY(k, bits) SHIFT_BODY(ROR, k, bits)
+#define rcl_BODY(k, bits) SHIFT_BODY(RCL, k, bits)
+#define rcr_BODY(k, bits) SHIFT_BODY(RCR, k, bits)
+#define shl_BODY(k, bits) SHIFT_BODY(SHL, k, bits)
+#define shr_BODY(k, bits) SHIFT_BODY(SHR, k, bits)
+#define sar_BODY(k, bits) SHIFT_BODY(SAR, k, bits)
+
+#define DEFINE_GROUP_HANDLER(op, k, bits)                                      \
+  static void op##_##k(VM *vm, Decoded *d) {                                   \
+    uint16_t ea = effective_addr(vm, d);                                       \
+    (void)ea;                                                                  \
+    op##_BODY(k, bits)                                                         \
+  }
+
+#define DEFINE_GROUP_HANDLERS(op)                                              \
+  DEFINE_GROUP_HANDLER(op, r16, 16)                                            \
+  DEFINE_GROUP_HANDLER(op, mem16, 16)                                          \
+  DEFINE_GROUP_HANDLER(op, r8, 8)                                              \
+  DEFINE_GROUP_HANDLER(op, mem8, 8)
+
+#define GROUP_ROW(op) {op##_r16, op##_mem16, op##_r8, op##_mem8}
+
+DEFINE_GROUP_HANDLERS(test)
+DEFINE_GROUP_HANDLERS(not)
+DEFINE_GROUP_HANDLERS(neg)
+DEFINE_GROUP_HANDLERS(mul)
+DEFINE_GROUP_HANDLERS(imul)
+DEFINE_GROUP_HANDLERS(div)
+DEFINE_GROUP_HANDLERS(idiv)
+DEFINE_GROUP_HANDLERS(rol)
+DEFINE_GROUP_HANDLERS(ror)
+DEFINE_GROUP_HANDLERS(rcl)
+DEFINE_GROUP_HANDLERS(rcr)
+DEFINE_GROUP_HANDLERS(shl)
+DEFINE_GROUP_HANDLERS(shr)
+DEFINE_GROUP_HANDLERS(sar)
+
+/** indexed by Op from TEST on, and r16, mem16, r8, mem8 */
+static const Handler group_handlers[][4] = {
+    GROUP_ROW(test), GROUP_ROW(not), GROUP_ROW(neg), GROUP_ROW(mul),
+    GROUP_ROW(imul), GROUP_ROW(div), GROUP_ROW(idiv), GROUP_ROW(rol),
+    GROUP_ROW(ror), GROUP_ROW(rcl), GROUP_ROW(rcr), GROUP_ROW(shl),
+    GROUP_ROW(shr), GROUP_ROW(sar)};
+
+/** the port table, filled with the default handler when first needed */
+static PortHandler *port_table(VM *vm) {
+  if (vm->ports == NULL) {
+    vm->ports = malloc(0x10000 * sizeof(PortHandler));
+    for (int p = 0; p < 0x10000; p++) {
+      vm->ports[p] = vm->default_port;
+    }
+  }
+  return vm->ports;
+}
+
+/**
+ * Sets the device callbacks of a port; NULL for the default handler's. Once
+ * any port has a handler, IN and OUT no longer yield to the host.
+ */
+void set_port_handler(VM *vm, uint16_t port, PortIn in, PortOut out,
+                      void *ctx) {
+  PortHandler h = {in ? in : vm->default_port.in,
+                   out ? out : vm->default_port.out,
+                   in || out ? ctx : vm->default_port.ctx};
+  port_table(vm)[port] = h;
+}
+
+/** sets the handler of the ports without one of their own */
+void set_default_port_handler(VM *vm, PortIn in, PortOut out, void *ctx) {
+  PortHandler old = vm->default_port;
+  PortHandler h = {in ? in : open_bus_in, out ? out : ignore_out, ctx};
+  vm->default_port = h;
+  PortHandler *ports = port_table(vm);
+  for (int p = 0; p < 0x10000; p++) {
+    if (ports[p].in == old.in && ports[p].out == old.out &&
+        ports[p].ctx == old.ctx) {
+      ports[p] = h;
+    }
+  }
+}
+
+/** runs INT vector, and the interrupt, in the host; NULL for the guest */
+void set_interrupt_handler(VM *vm, uint8_t vector, InterruptHandler handler,
+                           void *ctx) {
+  vm->interrupts[vector] = handler;
+  vm->interrupt_ctx[vector] = ctx;
+}
+
+/** moves the vector table from address 0, e.g. past the program */
+void set_vector_table(VM *vm, uint16_t addr) { vm->vector_table = addr; }
+
+/** sets the kind of the pages holding [addr, addr + len) */
+static void map_pages(VM *vm, uint32_t addr, uint32_t len, uint8_t kind,
+                      MmioHandler h) {
+  if (len == 0) {
+    return;
+  }
+  uint32_t last = (addr + len - 1) >> PAGE_SHIFT;
+  for (uint32_t page = addr >> PAGE_SHIFT; page <= last && page < N_PAGES;
+       page++) {
+    vm->page_traps[page] &= ~(PAGE_ROM | PAGE_MMIO);
+    vm->page_traps[page] |= kind;
+    vm->mmio[page] = h;
+  }
+}
+
+/** makes the pages holding [addr, addr + len) plain RAM again */
+void map_ram(VM *vm, uint32_t addr, uint32_t len) {
+  MmioHandler none = {NULL, NULL, NULL};
+  map_pages(vm, addr, len, 0, none);
+}
+
+/**
+ * Makes the pages holding [addr, addr + len) read-only to the guest: its
+ * stores are dropped. Their contents are set through vm_memory.
+ */
+void map_rom(VM *vm, uint32_t addr, uint32_t len) {
+  MmioHandler none = {NULL, NULL, NULL};
+  map_pages(vm, addr, len, PAGE_ROM, none);
+}
+
+/**
+ * Maps a device into the pages holding [addr, addr + len): every load and
+ * store there goes to its callbacks, a byte at a time
+ */
+void map_mmio(VM *vm, uint32_t addr, uint32_t len, MmioRead read,
+              MmioWrite write, void *ctx) {
+  MmioHandler h = {read, write, ctx};
+  map_pages(vm, addr, len, PAGE_MMIO, h);
+}
+
+/**
+ * 8086 clocks per Op (MOV, ADD, SUB, CMP) and Shape, for word operands at even
+ * addresses; memory shapes add the effective address clocks on top
+ */
+static const uint8_t alu_clocks[4][N_SHAPES] = {
+    {2, 4, 8, 9, 10, 2, 4, 8, 9, 10},
+    {3, 4, 9, 16, 17, 3, 4, 9, 16, 17},
+    {3, 4, 9, 16, 17, 3, 4, 9, 16, 17},
+    {3, 4, 9, 9, 10, 3, 4, 9, 9, 10},
+};
+
+/** memory transfers per Op and Shape: read, write, or read and write */
+static const uint8_t alu_transfers[4][N_SHAPES] = {
+    {0, 0, 1, 1, 1, 0, 0, 1, 1, 1},
+    {0, 0, 1, 2, 2, 0, 0, 1, 2, 2},
+    {0, 0, 1, 2, 2, 0, 0, 1, 2, 2},
+    {0, 0, 1, 1, 1, 0, 0, 1, 1, 1},
+};
+
+/** clocks for jumps: {not taken, taken} */
+static const uint8_t jump_clocks[UNKNOWN_OP][2] = {
+    [JE] = {4, 16},   [JL] = {4, 16},     [JLE] = {4, 16},  [JB] = {4, 16},
+    [JBE] = {4, 16},  [JP] = {4, 16},     [JO] = {4, 16},   [JS] = {4, 16},
+    [JNE] = {4, 16},  [JNL] = {4, 16},    [JNLE] = {4, 16}, [JNB] = {4, 16},
+    [JNBE] = {4, 16}, [JNP] = {4, 16},    [JNO] = {4, 16},  [JNS] = {4, 16},
+    [LOOP] = {5, 17}, [LOOPZ] = {6, 18},  [LOOPNZ] = {5, 19},
+    [JCXZ] = {6, 18},
+};
+
+/** effective address calculation forms, see ea_clocks */
+typedef enum EaForm {
+  EA_DISP,
+  EA_BASE,
+  EA_BASE_DISP,
+  /** bp + di or bx + si */
+  EA_BP_DI,
+  /** bp + si or bx + di */
+  EA_BP_SI,
+  EA_BP_DI_DISP,
+  EA_BP_SI_DISP,
+} EaForm;
+
+static const uint8_t ea_clocks[] = {
+    [EA_DISP] = 6,        [EA_BASE] = 5,         [EA_BASE_DISP] = 9,
+    [EA_BP_DI] = 7,       [EA_BP_SI] = 8,        [EA_BP_DI_DISP] = 11,
+    [EA_BP_SI_DISP] = 12,
+};
+
+static EaForm ea_form(EffectiveAddr *e) {
+  int disp = e->operand3 != NO_DISP;
+  if (e->operand2 == NO_REG) {
+    return disp ? EA_BASE_DISP : EA_BASE;
+  }
+
+  int fast = (e->operand1 == BP && e->operand2 == DI) ||
+             (e->operand1 == BX && e->operand2 == SI);
+  if (fast) {
+    return disp ? EA_BP_DI_DISP : EA_BP_DI;
+  }
+  return disp ? EA_BP_SI_DISP : EA_BP_SI;
+}
+
+/** fills in the register slot (dst or src) or memory operand fields */
+static void decode_operand(Operand *o, Decoded *d, uint8_t *slot) {
+  switch (o->t) {
+  case REGISTER:
+    *slot = is_wide_reg(o->operand.reg.r) ? reg_to_index(o->operand.reg.r)
+                                          : reg8_to_index(o->operand.reg.r);
+    break;
+  case IMMEDIATE:
+    d->imm = o->operand.imm.val;
+    break;
+  case DIRECT_ADDR:
+    d->ea_base = ZERO_SLOT;
+    d->ea_index = ZERO_SLOT;
+    d->disp = o->operand.addr.addr;
+    d->ea_clocks = ea_clocks[EA_DISP];
+    break;
+  case EFFECTIVE_ADDR: {
+    EffectiveAddr e = o->operand.e_addr;
+    d->ea_base = reg_to_index(e.operand1);
+    d->ea_index = e.operand2 == NO_REG ? ZERO_SLOT : reg_to_index(e.operand2);
+    d->disp = e.operand3 == NO_DISP ? 0 : e.operand3;
+    d->ea_clocks = ea_clocks[ea_form(&e)];
+  } break;
+  }
+}
+
+static Handler pick_alu_handler(Instruction *i, Decoded *d) {
+  /** all of MovOp/AddOp/SubOp/CmpOp share the same layout */
+  MovOp *ops = &i->op_data.mov;
+  decode_operand(&ops->dst, d, &d->dst);
+  decode_operand(&ops->src, d, &d->src);
+  OperandType dk = ops->dst.t;
+  OperandType sk = ops->src.t;
+
+  int wide = i->wide;
+  if (ops->dst.t == REGISTER) {
+    wide = is_wide_reg(ops->dst.operand.reg.r);
+  }
+
+  Shape shape;
+  if (dk == REGISTER && sk == REGISTER) {
+    shape = R16_R16;
+  } else if (dk == REGISTER && sk == IMMEDIATE) {
+    shape = R16_IMM;
+  } else if (dk == REGISTER) {
+    shape = R16_MEM16;
+  } else if (sk == REGISTER) {
+    shape = MEM16_R16;
+  } else {
+    shape = MEM16_IMM;
+  }
+
+  /** the 8 bit shapes mirror the 16 bit ones, N_SHAPES / 2 further along */
+  if (!wide) {
+    shape += R8_R8;
+  }
+
+  d->shape = shape;
+  d->clocks = alu_clocks[i->op_type][shape] + d->ea_clocks;
+  d->transfers = alu_transfers[i->op_type][shape];
+  return alu_handlers[i->op_type][shape];
+}
+
+static int is_jump(Op op) { return op >= JE && op <= JCXZ; }
+
+/**
+ * jumps, and the instructions that call the host or move ip themselves
+ * (DIV and IDIV with a divide error)
+ */
+static int ends_block(Op op) {
+  return is_jump(op) || op == IN || op == OUT || op == INT || op == IRET ||
+         op == CALL || op == RET || op == DIV || op == IDIV ||
+         op == UNKNOWN_OP;
+}
+
+/** decodes the instruction at offset and picks its handler */
+static Decoded *decode_at(VM *vm, size_t offset) {
+  unsigned char *ip = vm->memory + offset;
+  Decoded *d = &vm->code[offset];
+
+  /** a redecoded entry (after a store into code) keeps no stale fields */
+  memset(d, 0, sizeof(Decoded));
+  d->instr = parse_instr(&ip);
+  d->len = ip - (vm->memory + offset);
+  d->ea_base = ZERO_SLOT;
+  d->ea_index = ZERO_SLOT;
+
+  if (is_jump(d->instr.op_type)) {
+    d->target = offset + d->len + d->instr.op_data.cond_jmp.offset;
+    d->clocks = jump_clocks[d->instr.op_type][0];
+    d->taken_clocks = jump_clocks[d->instr.op_type][1] - d->clocks;
+  }
+
+  switch (d->instr.op_type) {
+  case MOV:
+  case ADD:
+  case SUB:
+  case CMP:
+    d->exec = pick_alu_handler(&d->instr, d);
+    break;
+  case JE:
+  case JL:
+  case JLE:
+  case JB:
+  case JBE:
+  case JP:
+  case JO:
+  case JS:
+  case JNE:
+  case JNL:
+  case JNLE:
+  case JNB:
+  case JNBE:
+  case JNP:
+  case JNO:
+  case JNS:
+  case LOOP:
+  case LOOPZ:
+  case LOOPNZ:
+  case JCXZ:
+    d->exec =
+        jump_handlers[d->instr.op_type][d->target > (uint32_t)vm->memory_len];
+    break;
+  case IN:
+  case OUT: {
+    Operand *port = &d->instr.op_data.port.port;
+    int variable = port->t == REGISTER;
+    if (variable) {
+      d->ea_base = reg_to_index(DX);
+    } else {
+      d->disp = port->operand.imm.val;
+    }
+    d->exec = d->instr.op_type == IN ? exec_in : exec_out;
+    d->clocks = variable ? 8 : 10;
+    break;
+  }
+  case INT:
+    d->imm = d->instr.op_data.intr.vector;
+    d->exec = exec_int;
+    d->clocks = d->len == 1 ? 52 : 51;
+    break;
+  case IRET:
+    d->exec = exec_iret;
+    d->clocks = 24;
+    break;
+  case PUSH:
+  case POP: {
+    Operand *o = &d->instr.op_data.stack.operand;
+    int push = d->instr.op_type == PUSH;
+    decode_operand(o, d, push ? &d->src : &d->dst);
+    if (o->t == REGISTER) {
+      d->exec = push ? exec_push_r16 : exec_pop_r16;
+      d->clocks = push ? 11 : 8;
+      d->transfers = 1;
+    } else {
+      d->exec = push ? exec_push_mem16 : exec_pop_mem16;
+      d->clocks = (push ? 16 : 17) + d->ea_clocks;
+      d->transfers = 2;
+    }
+    break;
+  }
+  case CALL:
+    d->target = offset + d->len + d->instr.op_data.call.offset;
+    d->exec = d->target <= (uint32_t)vm->memory_len ? exec_call : fault;
+    d->clocks = 19;
+    d->transfers = 1;
+    break;
+  case RET:
+    d->imm = d->instr.op_data.ret.pop;
+    d->exec = exec_ret;
+    d->clocks = d->imm ? 12 : 8;
+    d->transfers = 1;
+    break;
+  case MOVS:
+  case CMPS:
+  case STOS:
+  case LODS:
+  case SCAS: {
+    Op op = d->instr.op_type;
+    d->exec = string_handlers[op - MOVS];
+    d->clocks = d->instr.op_data.string.rep ? 9 : string_clocks[op][0];
+    d->transfers = op == MOVS || op == CMPS ? 2 : 1;
+    break;
+  }
+  case CLD:
+  case STD:
+    d->exec = d->instr.op_type == CLD ? exec_cld : exec_std;
+    d->clocks = 2;
+    break;
+  case CLI:
+  case STI:
+    d->exec = d->instr.op_type == CLI ? exec_cli : exec_sti;
+    d->clocks = 2;
+    break;
+  case TEST:
+  case NOT:
+  case NEG:
+  case MUL:
+  case IMUL:
+  case DIV:
+  case IDIV:
+  case ROL:
+  case ROR:
+  case RCL:
+  case RCR:
+  case SHL:
+  case SHR:
+  case SAR: {
+    Op op = d->instr.op_type;
+    GroupOp *g = &d->instr.op_data.group;
+    int wide = d->instr.wide;
+    int mem = g->dst.t != REGISTER;
+    decode_operand(&g->dst, d, &d->dst);
+    d->exec = group_handlers[op - TEST][!wide * 2 + mem];
+    if (op == TEST) {
+      d->imm = g->src.operand.imm.val;
+      d->clocks = mem ? 11 : 5;
+      d->transfers = mem;
+    } else if (op == NOT || op == NEG) {
+      d->clocks = mem ? 16 : 3;
+      d->transfers = mem * 2;
+    } else if (op <= IDIV) {
+      d->clocks = muldiv_clocks[op - MUL][wide][0] + mem * 6;
+      d->transfers = mem;
+    } else {
+      /** imm is 1 for shifts by 1, 0 for shifts by cl */
+      d->imm = g->src.t == IMMEDIATE;
+      d->clocks = mem ? (d->imm ? 15 : 20) : (d->imm ? 2 : 8);
+      d->transfers = mem * 2;
+    }
+    d->clocks += d->ea_clocks;
+  } break;
+  case UNKNOWN_OP:
+    d->exec = exec_unknown;
+    break;
+  default:
+    d->exec = exec_nop;
+    break;
+  }
+
+  if (vm->filter && !vm->filter(&d->instr)) {
+    d->exec = exec_nop;
+  }
+  return d;
+}
+
+/** the predecoded instruction at offset, decoding it if ip never got there */
+static inline Decoded *decoded_at(VM *vm, size_t offset) {
+  Decoded *d = &vm->code[offset];
+  return d->exec ? d : decode_at(vm, offset);
+}
+
+/** marks the target and the fall-through of a jump at offset as leaders */
+static void mark_leaders(VM *vm, Decoded *d, size_t offset) {
+  if (is_jump(d->instr.op_type) || d->instr.op_type == CALL) {
+    if (d->target < (uint32_t)vm->memory_len) {
+      vm->leaders[d->target] |= LEADER_JUMP;
+    }
+    if (offset + d->len < (size_t)vm->memory_len) {
+      vm->leaders[offset + d->len] |= LEADER_JUMP;
+    }
+  }
+}
+
+/** sends stores to the program's pages through page_trap */
+static void trap_code_pages(VM *vm) {
+  for (uint32_t page = 0;
+       page < N_PAGES && page << PAGE_SHIFT < (uint32_t)vm->memory_len;
+       page++) {
+    vm->page_traps[page] |= PAGE_CODE;
+  }
+}
+
+/**
+ * Decodes the loaded program once, picking a handler per instruction, and
+ * marks jump targets and fall-throughs as block leaders.
+ */
+static void predecode(VM *vm) {
+  vm->code = calloc(vm->memory_len, sizeof(Decoded));
+  vm->blocks = calloc(vm->memory_len, sizeof(Block));
+  vm->leaders = calloc(vm->memory_len, 1);
+
+  size_t offset = 0;
+  while (offset < (size_t)vm->memory_len) {
+    Decoded *d = decode_at(vm, offset);
+    mark_leaders(vm, d, offset);
+    offset += d->len;
+  }
+  trap_code_pages(vm);
+}
+
+/**
+ * Builds the block starting at offset into b: it extends up to and
+ * including the first jump, or up to the next leader or the end of the
+ * program.
+ */
+static void build_block(VM *vm, Block *b, size_t offset) {
+  size_t o = offset;
+  do {
+    Decoded *d = decoded_at(vm, o);
+    b->n_instrs++;
+    b->clocks += d->clocks;
+    o += d->len;
+    if (ends_block(d->instr.op_type)) {
+      break;
+    }
+  } while (o < (size_t)vm->memory_len && !vm->leaders[o] &&
+           b->n_instrs < UINT16_MAX);
+
+  b->end = o;
+}
+
+/** stops at a breakpoint, unless running on from it */
+static void hit_breakpoint(VM *vm) {
+  if (vm->instrs != vm->resume_instrs) {
+    stop_soon(vm, STOP_BREAKPOINT);
+  }
+}
+
+/**
+ * The block starting at offset, built on first use. Blocks at breakpoints
+ * are never kept, so that each time one is reached it comes back here to
+ * stop; all other blocks run without checking for breakpoints.
+ */
+static Block *block_at(VM *vm, size_t offset) {
+  Block *b = &vm->blocks[offset];
+  if (b->n_instrs) {
+    return b;
+  }
+
+  if (vm->leaders[offset] & LEADER_BREAKPOINT) {
+    hit_breakpoint(vm);
+    b = &vm->break_block;
+    b->n_instrs = 0;
+    b->clocks = 0;
+  }
+  build_block(vm, b, offset);
+  return b;
+}
+
+/** drops the blocks that run over offset, to rebuild them split there */
+static void split_blocks_at(VM *vm, size_t offset) {
+  for (size_t o = 0; o <= offset; o++) {
+    Block *b = &vm->blocks[o];
+    if (b->n_instrs && b->end > offset) {
+      Block empty = {0};
+      *b = empty;
+    }
+  }
+}
+
+void set_breakpoint(VM *vm, size_t offset) {
+  vm->leaders[offset] |= LEADER_BREAKPOINT;
+  split_blocks_at(vm, offset);
+}
+
+void clear_breakpoint(VM *vm, size_t offset) {
+  vm->leaders[offset] &= ~LEADER_BREAKPOINT;
+  /** merging back is not worth it: the split blocks still run the same */
+  Block empty = {0};
+  vm->blocks[offset] = empty;
+}
+
+/** stops runs after stores to the len bytes at addr */
+void set_watchpoint(VM *vm, uint32_t addr, uint32_t len) {
+  vm->watches = realloc(vm->watches, (vm->n_watches + 1) * sizeof(Watch));
+  Watch w = {addr, len};
+  vm->watches[vm->n_watches++] = w;
+  for (uint32_t a = addr; a < addr + len && a < MEMORY_SIZE; a++) {
+    vm->page_traps[a >> PAGE_SHIFT] |= PAGE_WATCHED;
+  }
+}
+
+void clear_watchpoint(VM *vm, uint32_t addr, uint32_t len) {
+  int n = 0;
+  for (int i = 0; i < vm->n_watches; i++) {
+    Watch w = vm->watches[i];
+    if (w.addr != addr || w.len != len) {
+      vm->watches[n++] = w;
+    }
+  }
+  vm->n_watches = n;
+
+  set_page_traps(vm, PAGE_WATCHED, 0);
+  for (int i = 0; i < n; i++) {
+    Watch *w = &vm->watches[i];
+    for (uint32_t a = w->addr; a < w->addr + w->len && a < MEMORY_SIZE;
+         a++) {
+      vm->page_traps[a >> PAGE_SHIFT] |= PAGE_WATCHED;
+    }
+  }
+}
+
+void clear_watchpoints(VM *vm) {
+  free(vm->watches);
+  vm->watches = NULL;
+  vm->n_watches = 0;
+  set_page_traps(vm, PAGE_WATCHED, 0);
+}
+
+void enable_prefetch_model(VM *vm) {
+  Biu biu = {.enabled = 1,
+             .capacity = vm->cpu == CPU_8088 ? 4 : 6,
+             .fetch_bytes = vm->cpu == CPU_8088 ? 1 : 2,
+             .fill = 0,
+             .idle = 0,
+             .stalls = 0};
+  vm->biu = biu;
+}
+
+/**
+ * Advances the queue model over one executed instruction that took `spent`
+ * clocks in the EU.
+ */
+static void prefetch_step(VM *vm, Decoded *d, uint64_t spent, int taken) {
+  Biu *b = &vm->biu;
+
+  if (b->fill < d->len) {
+    int fetches = (d->len - b->fill + b->fetch_bytes - 1) / b->fetch_bytes;
+    int wait = fetches * 4 - b->idle;
+    b->stalls += wait > 0 ? wait : 0;
+    b->fill += fetches * b->fetch_bytes;
+    b->idle = 0;
+  }
+  b->fill -= d->len;
+
+  if (taken) {
+    b->fill = 0;
+    b->idle = 0;
+    return;
+  }
+
+  /** word transfer penalties are extra bus cycles, not EU work */
+  int data_clocks = d->transfers ? d->transfers * 4 + (spent - d->clocks) : 0;
+  int free_clocks = (int)spent - data_clocks + b->idle;
+  if (free_clocks < 0) {
+    free_clocks = 0;
+  }
+
+  int fill = b->fill + (free_clocks / 4) * b->fetch_bytes;
+  if (fill >= b->capacity) {
+    b->fill = b->capacity;
+    b->idle = 0;
+  } else {
+    b->fill = fill;
+    b->idle = free_clocks % 4;
+  }
+}
+
+void enable_profile(VM *vm) {
+  vm->profile = calloc(vm->memory_len, sizeof(ProfileEntry));
+}
+
+void enable_callpaths(VM *vm) {
+  CallPaths *cp = &vm->callpaths;
+  cp->cap_nodes = 64;
+  cp->nodes = calloc(cp->cap_nodes, sizeof(CallPath));
+  cp->n_nodes = 1;
+  cp->cap_edges = 128;
+  cp->edge_keys = calloc(cp->cap_edges, sizeof(uint64_t));
+  cp->edge_children = calloc(cp->cap_edges, sizeof(uint32_t));
+  cp->cap_stack = 64;
+  cp->stack = malloc(cp->cap_stack * sizeof(uint32_t));
+  cp->returns = malloc(cp->cap_stack * sizeof(uint32_t));
+  cp->depth = 0;
+  cp->current = 0;
+}
+
+static void free_callpaths(VM *vm) {
+  CallPaths *cp = &vm->callpaths;
+  free(cp->nodes);
+  free(cp->edge_keys);
+  free(cp->edge_children);
+  free(cp->stack);
+  free(cp->returns);
+}
+
+static uint32_t edge_slot(CallPaths *cp, uint64_t key) {
+  uint32_t mask = cp->cap_edges - 1;
+  uint32_t slot = (key * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+  while (cp->edge_children[slot] && cp->edge_keys[slot] != key) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static void grow_edges(CallPaths *cp) {
+  uint64_t *keys = cp->edge_keys;
+  uint32_t *children = cp->edge_children;
+  uint32_t cap = cp->cap_edges;
+
+  cp->cap_edges *= 2;
+  cp->edge_keys = calloc(cp->cap_edges, sizeof(uint64_t));
+  cp->edge_children = calloc(cp->cap_edges, sizeof(uint32_t));
+  for (uint32_t i = 0; i < cap; i++) {
+    if (children[i]) {
+      uint32_t slot = edge_slot(cp, keys[i]);
+      cp->edge_keys[slot] = keys[i];
+      cp->edge_children[slot] = children[i];
+    }
+  }
+  free(keys);
+  free(children);
+}
+
+/** the call path for calling `entry` from path `parent`, added if new */
+static uint32_t callpath_child(CallPaths *cp, uint32_t parent,
+                               uint32_t entry) {
+  uint64_t key = (uint64_t)parent << 32 | entry;
+  uint32_t slot = edge_slot(cp, key);
+  if (cp->edge_children[slot]) {
+    return cp->edge_children[slot];
+  }
+
+  if (cp->n_nodes == cp->cap_nodes) {
+    cp->cap_nodes *= 2;
+    cp->nodes = realloc(cp->nodes, cp->cap_nodes * sizeof(CallPath));
+  }
+  uint32_t child = cp->n_nodes++;
+  CallPath node = {.entry = entry, .parent = parent};
+  cp->nodes[child] = node;
+
+  cp->edge_keys[slot] = key;
+  cp->edge_children[slot] = child;
+  /** keep the load factor under 1/2 */
+  if (cp->n_nodes * 2 > cp->cap_edges) {
+    grow_edges(cp);
+  }
+  return child;
+}
+
+/** called by CALL when call paths are tracked; the call returns to ret */
+static void shadow_call(VM *vm, uint32_t entry, uint32_t ret) {
+  CallPaths *cp = &vm->callpaths;
+  if (cp->depth == cp->cap_stack) {
+    cp->cap_stack *= 2;
+    cp->stack = realloc(cp->stack, cp->cap_stack * sizeof(uint32_t));
+    cp->returns = realloc(cp->returns, cp->cap_stack * sizeof(uint32_t));
+  }
+  cp->returns[cp->depth] = ret;
+  cp->stack[cp->depth++] = cp->current;
+  cp->current = callpath_child(cp, cp->current, entry);
+}
+
+/**
+ * Called by RET: goes back to the path of the call that returns to target.
+ * That is the innermost call, unless the guest dropped frames (as longjmp
+ * does), when it is the outer one it returns to. A RET to no call's return
+ * address is a computed jump and stays in the current path.
+ */
+static void shadow_ret(VM *vm, uint32_t target) {
+  CallPaths *cp = &vm->callpaths;
+  for (uint32_t depth = cp->depth; depth > 0; depth--) {
+    if (cp->returns[depth - 1] == target) {
+      cp->current = cp->stack[depth - 1];
+      cp->depth = depth - 1;
+      return;
+    }
+  }
+}
+
+static void print_callpath(FILE *f, CallPaths *cp, uint32_t node) {
+  if (node == 0) {
+    fprintf(f, "top");
+    return;
+  }
+  print_callpath(f, cp, cp->nodes[node].parent);
+  fprintf(f, ";sub_%04x", cp->nodes[node].entry);
+}
+
+/**
+ * Writes one line per call path in the folded stack format read by flame
+ * graph scripts: frames separated by ';', then the path's own clocks (or
+ * samples, when sampling).
+ */
+void write_folded(VM *vm, FILE *f) {
+  CallPaths *cp = &vm->callpaths;
+  for (uint32_t i = 0; i < cp->n_nodes; i++) {
+    CallPath *node = &cp->nodes[i];
+    uint64_t count = vm->sampler.period ? node->samples : node->clocks;
+    if (count) {
+      print_callpath(f, cp, i);
+      fprintf(f, " %" PRIu64 "\n", count);
+    }
+  }
+}
+
+/** takes the samples that are due, at ip */
+static void take_samples(VM *vm) {
+  Sampler *s = &vm->sampler;
+  uint64_t now = s->by_clocks ? vm->clocks : vm->instrs;
+  while (s->next_at <= now) {
+    s->hits[vm->ip - vm->memory]++;
+    s->n_samples++;
+    s->next_at += s->period;
+    if (vm->callpaths.nodes) {
+      vm->callpaths.nodes[vm->callpaths.current].samples++;
+    }
+  }
+}
+
+/**
+ * Executes d under whichever of the prefetch queue model, profiler and call
+ * path tracking are enabled
+ */
+static void instrumented_tick(VM *vm, Decoded *d) {
+  uint64_t clocks_before = vm->clocks - d->clocks;
+  uint64_t stalls_before = vm->biu.stalls;
+  uint32_t callpath_before = vm->callpaths.current;
+  unsigned char *next = vm->ip;
+  d->exec(vm, d);
+
+  uint64_t spent = vm->clocks - clocks_before;
+  if (vm->biu.enabled) {
+    prefetch_step(vm, d, spent, vm->ip != next);
+    spent += vm->biu.stalls - stalls_before;
+  }
+
+  size_t offset = next - d->len - vm->memory;
+  if (vm->profile) {
+    ProfileEntry *e = &vm->profile[offset];
+    e->hits++;
+    e->clocks += spent;
+  }
+
+  /** attributed to the path the instruction ran in, before a CALL/RET */
+  if (vm->callpaths.nodes) {
+    CallPath *path = &vm->callpaths.nodes[callpath_before];
+    path->instrs++;
+    path->clocks += spent;
+  }
+}
+
+static const ProfileEntry *sort_profile;
+
+static int by_clocks_desc(const void *a, const void *b) {
+  uint64_t ca = sort_profile[*(const size_t *)a].clocks;
+  uint64_t cb = sort_profile[*(const size_t *)b].clocks;
+  if (ca != cb) {
+    return ca < cb ? 1 : -1;
+  }
+  return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+/**
+ * Adds the counted runs of the block at start to the hits and clocks of its
+ * instructions: what they cost beyond their decoded clocks (taken jumps,
+ * odd addresses, repeats) was already added to their entries as they ran
+ */
+static void flush_block_runs(VM *vm, size_t start) {
+  ProfileEntry *p = vm->profile;
+  uint64_t runs = p[start].runs;
+  for (size_t o = start; o < p[start].run_end; o += vm->code[o].len) {
+    p[o].hits += runs;
+    p[o].clocks += runs * vm->code[o].clocks;
+  }
+  p[start].runs = 0;
+}
+
+static void flush_profile(VM *vm) {
+  for (size_t o = 0; o < (size_t)vm->memory_len; o++) {
+    if (vm->profile[o].runs) {
+      flush_block_runs(vm, o);
+    }
+  }
+}
+
+/**
+ * Brings the predecoded instructions up to date after stores into the
+ * program: the entries over the bytes stored are decoded again, and every
+ * block is dropped to be rebuilt from them
+ */
+static void refresh_code(VM *vm) {
+  /** counted over the blocks as they were */
+  if (vm->profile) {
+    flush_profile(vm);
+  }
+  /** instructions are at most 6 bytes long */
+  uint32_t lo = vm->code_lo > 5 ? vm->code_lo - 5 : 0;
+  for (uint32_t o = lo; o <= vm->code_hi; o++) {
+    if (vm->code[o].exec) {
+      mark_leaders(vm, decode_at(vm, o), o);
+    }
+  }
+  memset(vm->blocks, 0, vm->memory_len * sizeof(Block));
+  vm->code_stored = 0;
+}
+
+/**
+ * Ends the running block after d, which stored into the program: the
+ * `left` instructions after it, charged with the block, are taken back
+ */
+static void cut_block(VM *vm, Decoded *d, int left) {
+  size_t o = d - vm->code + d->len;
+  vm->ip = vm->memory + o;
+  vm->instrs -= left;
+  /** the run of the block was counted whole: these did not run */
+  if (vm->profile && left) {
+    flush_profile(vm);
+  }
+  for (; left > 0; left--) {
+    vm->clocks -= vm->code[o].clocks;
+    if (vm->profile) {
+      vm->profile[o].hits--;
+      vm->profile[o].clocks -= vm->code[o].clocks;
+    }
+    o += vm->code[o].len;
+  }
+}
+
+/** prints every executed instruction, most expensive first */
+void dump_profile(VM *vm) {
+  flush_profile(vm);
+  ProfileEntry *p = vm->profile;
+  size_t *offsets = malloc(vm->memory_len * sizeof(size_t));
+  size_t n = 0;
+  uint64_t total = 0;
+  for (size_t offset = 0; offset < (size_t)vm->memory_len; offset++) {
+    if (p[offset].hits) {
+      offsets[n++] = offset;
+      total += p[offset].clocks;
+    }
+  }
+
+  sort_profile = p;
+  qsort(offsets, n, sizeof(size_t), by_clocks_desc);
+
+  printf("profile: %" PRIu64 " clocks\n", total);
+  printf("%10s %6s %10s %6s  %s\n", "clocks", "%", "hits", "offset",
+         "instruction");
+  for (size_t i = 0; i < n; i++) {
+    size_t offset = offsets[i];
+    printf("%10" PRIu64 " %5.1f%% %10" PRIu64 " %6zu  ", p[offset].clocks,
+           total ? 100.0 * p[offset].clocks / total : 0.0, p[offset].hits,
+           offset);
+    print_instr(&vm->code[offset].instr);
+    printf("\n");
+  }
+  free(offsets);
+}
+
+/** prints the instruction and every register it changed */
+static void trace_tick(VM *vm, Decoded *d) {
+  uint16_t before[8];
+  memcpy(before, vm->registers, sizeof(before));
+  uint64_t clocks_before = vm->clocks - d->clocks;
+  uint64_t stalls_before = vm->biu.stalls;
+
+  print_instr(&d->instr);
+  printf(" ::");
+  if (vm->biu.enabled || vm->profile || vm->callpaths.nodes) {
+    instrumented_tick(vm, d);
+  } else {
+    d->exec(vm, d);
+  }
+
+  for (int r = 0; r < 8; r++) {
+    if (vm->registers[r] != before[r]) {
+      printf(" ");
+      print_reg_by_idx(r);
+      printf(": %d -> %d", before[r], vm->registers[r]);
+    }
+  }
+
+  if (vm->show_clocks) {
+    uint64_t spent = vm->clocks - clocks_before;
+    printf(" clocks: +%" PRIu64 " = %" PRIu64, spent, vm->clocks);
+    if (d->ea_clocks) {
+      printf(" (%d + %dea", d->clocks - d->ea_clocks, d->ea_clocks);
+      if (spent > d->clocks) {
+        printf(" + %" PRIu64 "p", spent - d->clocks);
+      }
+      printf(")");
+    }
+    if (vm->biu.stalls > stalls_before) {
+      printf(" + %" PRIu64 " queue stall", vm->biu.stalls - stalls_before);
+    }
+  }
+  printf("\n");
+}
+
+static void put_varint(FILE *f, uint64_t v) {
+  while (v >= 0x80) {
+    fputc((v & 0x7F) | 0x80, f);
+    v >>= 7;
+  }
+  fputc(v, f);
+}
+
+static int get_varint(FILE *f, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(f);
+    if (c == EOF) {
+      return 0;
+    }
+    *v |= (uint64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void journal_write(Journal *j, Event e) {
+  fputc(e.kind, j->f);
+  if (e.kind != EVENT_PORT_IN && e.kind != EVENT_MMIO_IN) {
+    put_varint(j->f, e.instrs - j->last_instrs);
+    j->last_instrs = e.instrs;
+  }
+  put_varint(j->f, e.arg);
+  put_varint(j->f, e.value);
+  j->n_events++;
+}
+
+/** reads the next event ahead; a truncated log reads as its end */
+static void journal_read(Journal *j) {
+  j->next_offset = ftell(j->f);
+  j->next_base = j->last_instrs;
+  Event e = {.kind = fgetc(j->f), .instrs = j->last_instrs};
+  uint64_t delta = 0, arg = 0;
+  int ok = e.kind == EVENT_PORT_IN || e.kind == EVENT_MMIO_IN ||
+           get_varint(j->f, &delta);
+  ok = ok && get_varint(j->f, &arg) && get_varint(j->f, &e.value);
+  if (!ok || e.kind > EVENT_MMIO_IN) {
+    e.kind = EVENT_END;
+    e.instrs = UINT64_MAX;
+  } else {
+    e.instrs += delta;
+    e.arg = arg;
+  }
+  j->last_instrs = e.instrs;
+  j->next = e;
+}
+
+/** the instruction count and clocks the run loops must stop at next */
+static void update_deadline(VM *vm) {
+  uint64_t deadline = UINT64_MAX;
+  if (vm->journal.mode == JOURNAL_REPLAY) {
+    if (vm->journal.next.kind == EVENT_INTERRUPT) {
+      deadline = vm->journal.next.instrs;
+    }
+  }
+  if (vm->timeline.interval && vm->timeline.next_at < deadline) {
+    deadline = vm->timeline.next_at;
+  }
+  if (vm->stop_at < deadline) {
+    deadline = vm->stop_at;
+  }
+  Sampler *s = &vm->sampler;
+  if (s->period && !s->by_clocks && s->next_at < deadline) {
+    deadline = s->next_at;
+  }
+  if (vm->pending_stop) {
+    deadline = 0;
+  }
+  vm->clock_deadline = vm->clock_limit;
+  if (vm->timers.len && !vm->timeline.replaying &&
+      vm->timers.heap[0].at < vm->clock_deadline) {
+    vm->clock_deadline = vm->timers.heap[0].at;
+  }
+  if (s->period && s->by_clocks && s->next_at < vm->clock_deadline) {
+    vm->clock_deadline = s->next_at;
+  }
+  atomic_store(&vm->deadline, deadline);
+  /** requests made since are not lost: checked after the store */
+  if ((vm->journal.mode != JOURNAL_REPLAY && vm->flags & 1 << 9 &&
+       atomic_load(&vm->irq)) ||
+      atomic_load(&vm->cancel)) {
+    atomic_store(&vm->deadline, 0);
+  }
+}
+
+/**
+ * Requests an interrupt, delivered before the next block starts; while the
+ * guest has IF clear it stays pending until IF is set. Safe to call from
+ * other threads and from signal handlers.
+ */
+void request_interrupt(VM *vm, uint8_t vector) {
+  atomic_store(&vm->irq, vector + 1);
+  atomic_store(&vm->deadline, 0);
+}
+
+/** stops the run at the next block; safe to call from other threads */
+void cancel_run(VM *vm) {
+  atomic_store(&vm->cancel, 1);
+  atomic_store(&vm->deadline, 0);
+}
+
+/** a hardware interrupt, taken between blocks (or instructions) */
+static void deliver_interrupt(VM *vm, uint8_t vector) {
+  if (vm->trace) {
+    printf("interrupt %d at %" PRIu64 "\n", vector, vm->instrs);
+  }
+  vm->clocks += 61;
+  if (enter_interrupt(vm, vector)) {
+    stop_soon(vm, STOP_FAULT);
+  }
+}
+
+static void take_checkpoint(VM *vm);
+static void record_input(VM *vm, EventKind kind, uint32_t arg,
+                         uint64_t value);
+static void end_replay_if_done(VM *vm);
+
+static int timer_before(const Timer *a, const Timer *b) {
+  return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void timer_sift_up(Timers *t, size_t i) {
+  Timer timer = t->heap[i];
+  while (i > 0 && timer_before(&timer, &t->heap[(i - 1) / 2])) {
+    t->heap[i] = t->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  t->heap[i] = timer;
+}
+
+static void timer_sift_down(Timers *t, size_t i) {
+  Timer timer = t->heap[i];
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= t->len) {
+      break;
+    }
+    if (child + 1 < t->len &&
+        timer_before(&t->heap[child + 1], &t->heap[child])) {
+      child++;
+    }
+    if (!timer_before(&t->heap[child], &timer)) {
+      break;
+    }
+    t->heap[i] = t->heap[child];
+    i = child;
+  }
+  t->heap[i] = timer;
+}
+
+/** removes the timer at heap index i */
+static void timer_remove(Timers *t, size_t i) {
+  t->heap[i] = t->heap[--t->len];
+  if (i < t->len) {
+    timer_sift_down(t, i);
+    timer_sift_up(t, i);
+  }
+}
+
+/**
+ * Fires the timers that are due, each with the clock it was scheduled for
+ * rather than the clock it fired at: a handler that schedules the next tick
+ * at `at` plus a period keeps exact time however late a block let it run.
+ */
+static void fire_timers(VM *vm) {
+  Timers *t = &vm->timers;
+  while (t->len && t->heap[0].at <= vm->clocks) {
+    Timer timer = t->heap[0];
+    timer_remove(t, 0);
+    timer.fire(vm, timer.at, timer.ctx);
+  }
+}
+
+/**
+ * Schedules fire(vm, at, ctx) for when the clock estimate reaches `at`. It
+ * runs between instructions, before a hardware interrupt due then is taken,
+ * so a handler can raise one with request_interrupt. Timers are state of
+ * the host's devices: snapshots and seeking do not bring them back, and
+ * they don't fire while the history is replayed, which already holds the
+ * interrupts and inputs they led to.
+ */
+void schedule_timer(VM *vm, uint64_t at, TimerHandler fire, void *ctx) {
+  Timers *t = &vm->timers;
+  if (t->len == t->cap) {
+    t->cap = t->cap ? 2 * t->cap : 16;
+    t->heap = realloc(t->heap, t->cap * sizeof(Timer));
+  }
+  t->heap[t->len] = (Timer){at, t->seq++, fire, ctx};
+  timer_sift_up(t, t->len++);
+  update_deadline(vm);
+}
+
+/** cancels the pending timers of fire with ctx */
+void cancel_timer(VM *vm, TimerHandler fire, void *ctx) {
+  Timers *t = &vm->timers;
+  for (size_t i = t->len; i-- > 0;) {
+    if (t->heap[i].fire == fire && t->heap[i].ctx == ctx) {
+      timer_remove(t, i);
+    }
+  }
+  update_deadline(vm);
+}
+
+/**
+ * Called by the run loops once vm->instrs reaches the deadline or vm->clocks
+ * the clock deadline: fires the timers, takes the samples and checkpoint and
+ * delivers the interrupt that are due (interrupts are logged when recording and
+ * taken from the log when replaying, where interrupts requested live are
+ * ignored). Returns nonzero when the run must stop.
+ */
+static int handle_deadline(VM *vm) {
+  if (!vm->timeline.replaying) {
+    fire_timers(vm);
+  }
+  if (vm->sampler.period) {
+    take_samples(vm);
+  }
+  if (vm->timeline.interval && vm->instrs >= vm->timeline.next_at) {
+    take_checkpoint(vm);
+  }
+
+  Journal *j = &vm->journal;
+  int irq = vm->flags & 1 << 9 ? atomic_exchange(&vm->irq, 0) : 0;
+  if (j->mode == JOURNAL_REPLAY) {
+    if (j->next.kind == EVENT_INTERRUPT && j->next.instrs <= vm->instrs) {
+      uint8_t vector = j->next.arg;
+      journal_read(j);
+      record_input(vm, EVENT_INTERRUPT, vector, 0);
+      end_replay_if_done(vm);
+      deliver_interrupt(vm, vector);
+    }
+  } else if (irq) {
+    record_input(vm, EVENT_INTERRUPT, irq - 1, 0);
+    deliver_interrupt(vm, irq - 1);
+  }
+  if (atomic_exchange(&vm->cancel, 0)) {
+    stop_soon(vm, STOP_CANCELLED);
+  }
+  StopReason stop = vm->pending_stop;
+  vm->pending_stop = STOP_NONE;
+  update_deadline(vm);
+  if (stop == STOP_BREAKPOINT) {
+    vm->resume_instrs = vm->instrs;
+  } else if (stop == STOP_NONE && (vm->instrs >= vm->stop_at ||
+                                    vm->clocks >= vm->clock_limit)) {
+    stop = STOP_BUDGET;
+  }
+  vm->stopped = stop;
+  return stop != STOP_NONE;
+}
+
+/**
+ * Replaying: takes the logged value of the next input if it is the read of
+ * `kind` at arg; otherwise the replay has diverged, and it returns 0
+ */
+static int replay_input(VM *vm, EventKind kind, uint32_t arg,
+                        uint64_t *value) {
+  Journal *j = &vm->journal;
+  if (j->next.kind != kind || j->next.arg != arg) {
+    j->diverged = 1;
+    end_replay_if_done(vm);
+    return 0;
+  }
+  *value = j->next.value;
+  journal_read(j);
+  end_replay_if_done(vm);
+  update_deadline(vm);
+  return 1;
+}
+
+/**
+ * Logs an input: to the journal when recording, and to the history of a VM
+ * taking checkpoints unless the input came from that history
+ */
+static void record_input(VM *vm, EventKind kind, uint32_t arg,
+                         uint64_t value) {
+  Event e = {kind, vm->instrs, arg, value};
+  if (vm->journal.mode == JOURNAL_RECORD) {
+    journal_write(&vm->journal, e);
+  }
+  if (vm->timeline.history.f && !vm->timeline.replaying) {
+    journal_write(&vm->timeline.history, e);
+  }
+}
+
+/**
+ * Reads an I/O port: from the device through `read` unless replaying, when
+ * the recorded value is returned and the device is not touched
+ */
+uint16_t journal_in(VM *vm, uint16_t port,
+                    uint16_t (*read)(VM *vm, uint16_t port)) {
+  uint64_t value;
+  if (vm->journal.mode != JOURNAL_REPLAY ||
+      !replay_input(vm, EVENT_PORT_IN, port, &value)) {
+    value = read(vm, port);
+  }
+  record_input(vm, EVENT_PORT_IN, port, value);
+  return value;
+}
+
+/** a load from a memory-mapped device, logged like a port read */
+static uint8_t mmio_read(VM *vm, uint32_t addr) {
+  uint64_t value;
+  if (vm->journal.mode != JOURNAL_REPLAY ||
+      !replay_input(vm, EVENT_MMIO_IN, addr, &value)) {
+    MmioHandler *h = &vm->mmio[addr >> PAGE_SHIFT];
+    value = h->read(vm, addr, h->ctx);
+  }
+  record_input(vm, EVENT_MMIO_IN, addr, value);
+  return value;
+}
+
+static uint16_t completed_in(VM *vm, uint16_t port) {
+  (void)port;
+  return vm->in_value;
+}
+
+/**
+ * The value read by IN d from port when it is logged or replayed, or there
+ * are no port handlers, logged like journal_in. Without port handlers the
+ * host gives the value: the first time the VM yields before d instead and
+ * this returns nonzero, and the handler must leave the state alone; d runs
+ * again once the VM is resumed, and gets the value passed to vm_complete_in.
+ */
+static int port_in(VM *vm, Decoded *d, uint16_t port, uint16_t *value) {
+  if (vm->journal.mode != JOURNAL_REPLAY && !vm->in_ready) {
+    if (vm->ports == NULL) {
+      vm->wait = WAIT_PORT_IN;
+      vm->wait_port = port;
+      stop_before(vm, d, STOP_YIELD);
+      return 1;
+    }
+    PortHandler *h = &vm->ports[port];
+    vm->in_value = h->in(vm, port, d->instr.wide, h->ctx);
+    vm->in_ready = 1;
+  }
+  vm->in_ready = 0;
+  *value = journal_in(vm, port, completed_in);
+  return 0;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 0x100000001b3;
+  }
+  return h;
+}
+
+/** hash of the registers, flags, ip, clocks and all of memory */
+static uint64_t state_hash(VM *vm) {
+  uint64_t h = 0xcbf29ce484222325;
+  uint64_t ip = vm->ip - vm->memory;
+  h = fnv1a(h, vm->registers, 8 * sizeof(uint16_t));
+  h = fnv1a(h, &vm->flags, sizeof(vm->flags));
+  h = fnv1a(h, &ip, sizeof(ip));
+  h = fnv1a(h, &vm->clocks, sizeof(vm->clocks));
+  return fnv1a(h, vm->memory, MEMORY_SIZE);
+}
+
+#define JOURNAL_MAGIC "SIM86LOG"
+
+/**
+ * Starts recording to, or replaying from, the log at path. The log begins
+ * with a hash of the starting state, which a replay must start from too.
+ */
+int journal_open(VM *vm, const char *path, JournalMode mode) {
+  Journal *j = vm->timeline.replaying ? &vm->timeline.live : &vm->journal;
+  j->f = fopen(path, mode == JOURNAL_RECORD ? "w" : "r");
+  if (j->f == NULL) {
+    fprintf(stderr, "unable to open file %s\n", path);
+    return 1;
+  }
+  j->mode = mode;
+  j->last_instrs = vm->instrs;
+  j->n_events = 0;
+  j->diverged = 0;
+
+  uint64_t start = state_hash(vm);
+  if (mode == JOURNAL_RECORD) {
+    fwrite(JOURNAL_MAGIC, 1, 8, j->f);
+    put_varint(j->f, start);
+    return 0;
+  }
+
+  char magic[8];
+  uint64_t logged;
+  if (fread(magic, 1, 8, j->f) != 8 || memcmp(magic, JOURNAL_MAGIC, 8) ||
+      !get_varint(j->f, &logged)) {
+    fprintf(stderr, "%s: not a replay log\n", path);
+  } else if (logged != start) {
+    fprintf(stderr, "%s: recorded from a different program or state\n",
+            path);
+  } else {
+    journal_read(j);
+    update_deadline(vm);
+    return 0;
+  }
+  fclose(j->f);
+  j->mode = JOURNAL_OFF;
+  return 1;
+}
+
+/**
+ * Ends recording by logging the final state, or ends a replay by checking
+ * that it reached that same state; returns nonzero if the replay diverged
+ */
+int journal_close(VM *vm) {
+  Journal *j = vm->timeline.replaying ? &vm->timeline.live : &vm->journal;
+  Event end = {EVENT_END, vm->instrs, 0, state_hash(vm)};
+  if (j->mode == JOURNAL_RECORD) {
+    journal_write(j, end);
+    fprintf(stderr, "recorded %" PRIu64 " events\n", j->n_events - 1);
+  } else if (j->mode == JOURNAL_REPLAY) {
+    j->diverged |= j->next.kind != EVENT_END ||
+                   j->next.instrs != end.instrs || j->next.value != end.value;
+    fprintf(stderr, "replay %s after %" PRIu64 " instructions\n",
+            j->diverged ? "diverged" : "matched", vm->instrs);
+  }
+  if (j->f) {
+    fclose(j->f);
+    j->f = NULL;
+  }
+  j->mode = JOURNAL_OFF;
+  return j->diverged;
+}
+
+/**
+ * The per-instruction loops' check for breakpoints and the deadline;
+ * nonzero to stop
+ */
+static inline int tick_deadline(VM *vm) {
+  size_t offset = vm->ip - vm->memory;
+  if (vm->leaders[offset] & LEADER_BREAKPOINT) {
+    hit_breakpoint(vm);
+  }
+  if ((vm->instrs >= atomic_load_explicit(&vm->deadline,
+                                          memory_order_relaxed) ||
+       vm->clocks >= vm->clock_deadline) &&
+      handle_deadline(vm)) {
+    return 1;
+  }
+  vm->instrs++;
+  return 0;
+}
+
+void enable_sampler(VM *vm, uint64_t period, int by_clocks) {
+  Sampler s = {.period = period,
+               .by_clocks = by_clocks,
+               .next_at = (by_clocks ? vm->clocks : vm->instrs) + period,
+               .n_samples = 0,
+               .hits = calloc(vm->memory_len, sizeof(uint64_t))};
+  vm->sampler = s;
+  update_deadline(vm);
+}
+
+static const uint64_t *sort_samples;
+
+static int by_samples_desc(const void *a, const void *b) {
+  uint64_t sa = sort_samples[*(const size_t *)a];
+  uint64_t sb = sort_samples[*(const size_t *)b];
+  if (sa != sb) {
+    return sa < sb ? 1 : -1;
+  }
+  return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+/** prints the sampled instructions, most samples first */
+void dump_samples(VM *vm) {
+  Sampler *s = &vm->sampler;
+  size_t *offsets = malloc(vm->memory_len * sizeof(size_t));
+  size_t n = 0;
+  for (size_t offset = 0; offset < (size_t)vm->memory_len; offset++) {
+    if (s->hits[offset]) {
+      offsets[n++] = offset;
+    }
+  }
+
+  sort_samples = s->hits;
+  qsort(offsets, n, sizeof(size_t), by_samples_desc);
+
+  printf("samples: %" PRIu64 " (every %" PRIu64 " %s)\n", s->n_samples,
+         s->period, s->by_clocks ? "clocks" : "instructions");
+  for (size_t i = 0; i < n; i++) {
+    size_t offset = offsets[i];
+    printf("%10" PRIu64 " %5.1f%%  at %zu  ", s->hits[offset],
+           100.0 * s->hits[offset] / s->n_samples, offset);
+    print_instr(&decoded_at(vm, offset)->instr);
+    printf("\n");
+  }
+  free(offsets);
+}
+
+/**
+ * Runs block by block; with `callpaths` the block is attributed to the
+ * current call path, with `profiling` the block's runs are counted, with
+ * `prefetch` the queue model follows each instruction of the block. Always
+ * inlined with constant flags, so the plain loop carries no trace of these.
+ */
+static inline __attribute__((always_inline)) void
+run_blocks(VM *vm, const int callpaths, const int profiling,
+           const int prefetch) {
+  CallPaths *cp = &vm->callpaths;
+  vm->stopped = STOP_NONE;
+  while (vm->ip < vm->end) {
+    size_t start = vm->ip - vm->memory;
+    Block *b = block_at(vm, start);
+    uint64_t clocks_before = vm->clocks;
+    uint64_t stalls_before = vm->biu.stalls;
+    int n_instrs = b->n_instrs;
+    uint32_t end = b->end;
+    uint32_t clocks = b->clocks;
+
+    uint64_t deadline =
+        atomic_load_explicit(&vm->deadline, memory_order_relaxed);
+    if (__builtin_expect(vm->instrs + n_instrs > deadline ||
+                             vm->clocks + clocks > vm->clock_deadline,
+                         0)) {
+      if (vm->instrs >= deadline || vm->clocks >= vm->clock_deadline) {
+        if (handle_deadline(vm)) {
+          break;
+        }
+        continue;
+      }
+      /**
+       * Stop short of the deadlines: at the deadline in instructions, and
+       * before the first instruction to start at or after the clock
+       * deadline. Only the whole block ends in a jump.
+       */
+      int limit = vm->instrs + n_instrs > deadline
+                      ? (int)(deadline - vm->instrs)
+                      : n_instrs;
+      n_instrs = 0;
+      end = start;
+      clocks = 0;
+      while (n_instrs < limit && vm->clocks + clocks < vm->clock_deadline) {
+        clocks += vm->code[end].clocks;
+        end += vm->code[end].len;
+        n_instrs++;
+      }
+    }
+
+    /** only the last instruction can move ip, so it can be set up front */
+    vm->ip = vm->memory + end;
+    vm->clocks += clocks;
+    vm->instrs += n_instrs;
+    Decoded *d = &vm->code[start];
+    /** a CALL/RET can only be the last instruction, so this is the path */
+    CallPath *path = callpaths ? &cp->nodes[cp->current] : NULL;
+    if (profiling) {
+      /** a block cut short (or split) since is a different run */
+      ProfileEntry *e = &vm->profile[start];
+      if (e->run_end != end) {
+        flush_block_runs(vm, start);
+        e->run_end = end;
+      }
+      e->runs++;
+    }
+    for (int n = n_instrs; n > 0; n--) {
+      if (profiling || prefetch) {
+        uint64_t before = vm->clocks;
+        uint64_t stalls = vm->biu.stalls;
+        d->exec(vm, d);
+        uint64_t extra = vm->clocks - before;
+        if (prefetch) {
+          /** only the last instruction can have jumped */
+          prefetch_step(vm, d, d->clocks + extra,
+                        n == 1 && vm->ip != vm->memory + end);
+          extra += vm->biu.stalls - stalls;
+        }
+        if (profiling && extra) {
+          vm->profile[d - vm->code].clocks += extra;
+        }
+      } else {
+        d->exec(vm, d);
+      }
+      if (__builtin_expect(vm->code_stored, 0)) {
+        /** the rest of the block may have changed: run it as rebuilt */
+        cut_block(vm, d, n - 1);
+        n_instrs -= n - 1;
+        refresh_code(vm);
+        break;
+      }
+      d += d->len;
+    }
+
+    if (callpaths) {
+      path->instrs += n_instrs;
+      path->clocks += vm->clocks - clocks_before;
+      if (prefetch) {
+        path->clocks += vm->biu.stalls - stalls_before;
+      }
+    }
+  }
+}
+
+/**
+ * Runs until the end of the program or a stop: a breakpoint or watch, the
+ * budget in vm->stop_at and vm->clock_limit, cancel_run or a fault. All of
+ * these, and the timers, are checked once per block, through the deadlines.
+ */
+StopReason run(VM *vm) {
+  vm->stopped = STOP_NONE;
+  vm->wait = WAIT_NONE;
+  if (vm->trace || vm->hook) {
+    while (vm->ip < vm->end) {
+      if (tick_deadline(vm)) {
+        break;
+      }
+      Decoded *d = decoded_at(vm, vm->ip - vm->memory);
+      uint16_t before[8];
+      memcpy(before, vm->registers, sizeof(before));
+      vm->ip += d->len;
+      vm->clocks += d->clocks;
+      if (vm->trace) {
+        trace_tick(vm, d);
+      } else {
+        instrumented_tick(vm, d);
+      }
+      if (vm->hook) {
+        vm->hook(vm, &d->instr, before, vm->hook_ctx);
+      }
+      if (vm->code_stored) {
+        refresh_code(vm);
+      }
+    }
+  } else if (vm->biu.enabled) {
+    /** one loop for the queue model, with the others tested */
+    run_blocks(vm, vm->callpaths.nodes != NULL, vm->profile != NULL, 1);
+  } else if (vm->profile) {
+    /** one loop for profiling, with call paths tested */
+    run_blocks(vm, vm->callpaths.nodes != NULL, 1, 0);
+  } else if (vm->callpaths.nodes) {
+    run_blocks(vm, 1, 0, 0);
+  } else {
+    run_blocks(vm, 0, 0, 0);
+  }
+  return vm->stopped;
+}
+
+/** sets the budget of the following runs, counted from now; 0 for none */
+void set_budget(VM *vm, uint64_t max_instrs, uint64_t max_clocks) {
+  vm->stop_at = max_instrs ? vm->instrs + max_instrs : UINT64_MAX;
+  vm->clock_limit = max_clocks ? vm->clocks + max_clocks : UINT64_MAX;
+  update_deadline(vm);
+}
+
+/**
+ * Runs on from where the last run stopped, for up to max_instrs more
+ * instructions (0 for no limit). A VM keeps all its state between runs, so
+ * suspending and resuming costs no more than a return from run and a call:
+ * one host thread can drive many VMs, each a run at a time. A VM that
+ * yielded on an IN reads the value given to vm_complete_in, or yields
+ * again if there is none.
+ */
+StopReason vm_resume(VM *vm, uint64_t max_instrs) {
+  vm->stop_at = max_instrs ? vm->instrs + max_instrs : UINT64_MAX;
+  update_deadline(vm);
+  return run(vm);
+}
+
+/** what the VM waits for after a STOP_YIELD, and the port of an IN */
+WaitKind vm_waiting(VM *vm, uint16_t *port) {
+  if (port) {
+    *port = vm->wait_port;
+  }
+  return vm->wait;
+}
+
+/** the value read by the IN the VM yielded on */
+void vm_complete_in(VM *vm, uint16_t value) {
+  vm->in_value = value;
+  vm->in_ready = 1;
+}
+
+/**
+ * Makes the run yield with WAIT_EVENT after the current instruction, for a
+ * guest that has to wait for something of the host's. Only from the thread
+ * running the VM, e.g. in an instruction hook; other threads use cancel_run.
+ */
+void vm_yield(VM *vm) {
+  vm->wait = WAIT_EVENT;
+  stop_soon(vm, STOP_YIELD);
+}
+
+const char *stop_reason_name(StopReason reason) {
+  switch (reason) {
+  case STOP_NONE:
+    return "completed";
+  case STOP_BREAKPOINT:
+    return "breakpoint";
+  case STOP_WATCHPOINT:
+    return "watchpoint";
+  case STOP_BUDGET:
+    return "budget exhausted";
+  case STOP_CANCELLED:
+    return "cancelled";
+  case STOP_FAULT:
+    return "fault";
+  case STOP_YIELD:
+    return "yielded";
+  }
+  return "";
+}
+
+static int in_image(VM *vm, void *p) {
+  return vm->image && (char *)p >= (char *)vm->image &&
+         (char *)p < (char *)vm->image + vm->image_len;
+}
+
+static void free_vm(VM *vm) {
+  if (!in_image(vm, vm->code)) {
+    free(vm->code);
+    free(vm->blocks);
+    free(vm->leaders);
+  }
+  if (vm->image) {
+    munmap(vm->image, vm->image_len);
+  }
+}
+
+/** executes the single instruction at ip */
+void step(VM *vm) {
+  vm->instrs++;
+  Decoded *d = decoded_at(vm, vm->ip - vm->memory);
+  uint16_t before[8];
+  memcpy(before, vm->registers, sizeof(before));
+  vm->ip += d->len;
+  vm->clocks += d->clocks;
+  d->exec(vm, d);
+  if (vm->hook) {
+    vm->hook(vm, &d->instr, before, vm->hook_ctx);
+  }
+  if (vm->code_stored) {
+    refresh_code(vm);
+  }
+}
+
+/**
+ * Takes a snapshot of the VM to restore it to later. A VM has one snapshot
+ * at a time: taking a new one replaces it as the target of copy-on-write,
+ * and the old one must no longer be restored.
+ */
+Snapshot *vm_snapshot(VM *vm) {
+  Snapshot *s = malloc(sizeof(Snapshot));
+  memcpy(s->registers, vm->registers, sizeof(s->registers));
+  s->flags = vm->flags;
+  s->ip = vm->ip - vm->memory;
+  s->clocks = vm->clocks;
+  s->instrs = vm->instrs;
+  /** only the pages that get saved into are ever touched */
+  s->pages = malloc(MEMORY_SIZE);
+  s->n_saved = 0;
+
+  vm->snapshot = s;
+  set_page_traps(vm, PAGE_COW, 1);
+  return s;
+}
+
+/**
+ * Restores the VM to its snapshot s, which stays valid to be restored
+ * again; costs O(pages written since the snapshot or the last restore)
+ */
+void vm_restore(VM *vm, Snapshot *s) {
+  for (int i = 0; i < s->n_saved; i++) {
+    uint32_t page = s->saved[i];
+    unsigned char *p = vm->memory + page * PAGE_SIZE;
+    if (vm->page_traps[page] & PAGE_CODE &&
+        memcmp(p, s->pages + page * PAGE_SIZE, PAGE_SIZE) != 0) {
+      /** the program goes back as it was: decode it again */
+      uint32_t end = page * PAGE_SIZE + PAGE_SIZE;
+      note_code_store(vm, page * PAGE_SIZE);
+      note_code_store(vm, end < (uint32_t)vm->memory_len
+                              ? end - 1
+                              : (uint32_t)vm->memory_len - 1);
+    }
+    memcpy(p, s->pages + page * PAGE_SIZE, PAGE_SIZE);
+    vm->page_traps[page] |= PAGE_COW;
+  }
+  s->n_saved = 0;
+  if (vm->code_stored) {
+    refresh_code(vm);
+  }
+
+  memcpy(vm->registers, s->registers, sizeof(s->registers));
+  vm->flags = s->flags;
+  vm->ip = vm->memory + s->ip;
+  vm->clocks = s->clocks;
+  vm->instrs = s->instrs;
+  vm->wait = WAIT_NONE;
+  vm->in_ready = 0;
+}
+
+void free_snapshot(VM *vm, Snapshot *s) {
+  if (vm->snapshot == s) {
+    vm->snapshot = NULL;
+    set_page_traps(vm, PAGE_COW, 0);
+  }
+  free(s->pages);
+  free(s);
+}
+
+/**
+ * Starts taking a checkpoint every `interval` instructions, keeping at most
+ * `budget` bytes of saved pages
+ */
+void enable_checkpoints(VM *vm, uint64_t interval, size_t budget) {
+  Timeline t = {.interval = interval,
+                .budget = budget,
+                .checkpoints = NULL,
+                .marks = NULL,
+                .n_checkpoints = 0,
+                .cap_checkpoints = 0,
+                .next_at = vm->instrs,
+                .history = {.mode = JOURNAL_RECORD,
+                            .last_instrs = vm->instrs}};
+  vm->timeline = t;
+  vm->timeline.history.f =
+      open_memstream(&vm->timeline.log, &vm->timeline.log_len);
+  update_deadline(vm);
+}
+
+/**
+ * Ends a replay of the history once it has fed its last input, or once the
+ * run has diverged from it: the rest of it was another run's then, and is
+ * recorded over from here
+ */
+static void end_replay_if_done(VM *vm) {
+  Timeline *t = &vm->timeline;
+  Journal *j = &vm->journal;
+  if (!t->replaying || (j->next.kind != EVENT_END && !j->diverged)) {
+    return;
+  }
+  if (j->diverged) {
+    fseek(t->history.f, j->next_offset, SEEK_SET);
+    t->history.last_instrs = j->next_base;
+  }
+  fclose(j->f);
+  *j = t->live;
+  t->replaying = 0;
+  update_deadline(vm);
+}
+
+/** replays the inputs recorded since checkpoint k instead of the journal */
+static void start_replay(VM *vm, int k) {
+  Timeline *t = &vm->timeline;
+  if (t->replaying) {
+    fclose(vm->journal.f);
+    vm->journal = t->live;
+    t->replaying = 0;
+  }
+  fflush(t->history.f);
+  HistoryMark mark = t->marks[k];
+  FILE *f = (size_t)mark.offset < t->log_len
+                ? fmemopen(t->log, t->log_len, "r")
+                : NULL;
+  if (f) {
+    fseek(f, mark.offset, SEEK_SET);
+    t->live = vm->journal;
+    vm->journal = (Journal){
+        .mode = JOURNAL_REPLAY, .f = f, .last_instrs = mark.base};
+    t->replaying = 1;
+    journal_read(&vm->journal);
+  }
+  update_deadline(vm);
+}
+
+/** drops the inputs from before the oldest checkpoint, now unreachable */
+static void trim_history(Timeline *t) {
+  fflush(t->history.f);
+  long from = t->marks[0].offset;
+  size_t len = t->log_len - from;
+  char *kept = malloc(len);
+  memcpy(kept, t->log + from, len);
+  fclose(t->history.f);
+  free(t->log);
+  t->history.f = open_memstream(&t->log, &t->log_len);
+  fwrite(kept, 1, len, t->history.f);
+  free(kept);
+  for (int i = 0; i < t->n_checkpoints; i++) {
+    t->marks[i].offset -= from;
+  }
+}
+
+static void take_checkpoint(VM *vm) {
+  Timeline *t = &vm->timeline;
+  if (t->n_checkpoints == t->cap_checkpoints) {
+    t->cap_checkpoints = t->cap_checkpoints ? 2 * t->cap_checkpoints : 16;
+    t->checkpoints = realloc(t->checkpoints,
+                             t->cap_checkpoints * sizeof(Snapshot *));
+    t->marks = realloc(t->marks, t->cap_checkpoints * sizeof(HistoryMark));
+  }
+  /** re-executing, the inputs from here on are the replay's next one on */
+  HistoryMark mark = {ftell(t->history.f), t->history.last_instrs};
+  if (t->replaying) {
+    mark = (HistoryMark){vm->journal.next_offset, vm->journal.next_base};
+  }
+  t->marks[t->n_checkpoints] = mark;
+  t->checkpoints[t->n_checkpoints++] = vm_snapshot(vm);
+  t->next_at = vm->instrs + t->interval;
+
+  size_t saved = 0;
+  for (int i = 0; i < t->n_checkpoints; i++) {
+    saved += (size_t)t->checkpoints[i]->n_saved * PAGE_SIZE;
+  }
+  /** the oldest checkpoints go first: only they cannot be re-executed to */
+  int drop = 0;
+  while (saved > t->budget && drop < t->n_checkpoints - 1) {
+    saved -= (size_t)t->checkpoints[drop]->n_saved * PAGE_SIZE;
+    free_snapshot(vm, t->checkpoints[drop++]);
+  }
+  t->n_checkpoints -= drop;
+  memmove(t->checkpoints, t->checkpoints + drop,
+          t->n_checkpoints * sizeof(Snapshot *));
+  memmove(t->marks, t->marks + drop, t->n_checkpoints * sizeof(HistoryMark));
+  /** a replay still reads the history: trimmed at a later checkpoint */
+  if (drop && !t->replaying) {
+    trim_history(t);
+  }
+}
+
+static void free_checkpoints(VM *vm) {
+  Timeline *t = &vm->timeline;
+  for (int i = 0; i < t->n_checkpoints; i++) {
+    free_snapshot(vm, t->checkpoints[i]);
+  }
+  free(t->checkpoints);
+  free(t->marks);
+  t->checkpoints = NULL;
+  t->marks = NULL;
+  t->n_checkpoints = 0;
+  if (t->replaying) {
+    fclose(vm->journal.f);
+    vm->journal = t->live;
+    t->replaying = 0;
+  }
+  if (t->history.f) {
+    fclose(t->history.f);
+    free(t->log);
+    t->history.f = NULL;
+    t->log = NULL;
+  }
+  t->interval = 0;
+  update_deadline(vm);
+}
+
+/**
+ * Moves the VM to the state it had after `instrs` instructions: back to the
+ * nearest checkpoint at or before it, then forward by re-executing with the
+ * inputs recorded since. Costs O(pages written since that checkpoint +
+ * checkpoint interval). Returns nonzero if instrs is older than the oldest
+ * checkpoint kept.
+ */
+int vm_seek(VM *vm, uint64_t instrs) {
+  Timeline *t = &vm->timeline;
+  if (instrs < vm->instrs) {
+    int k = t->n_checkpoints - 1;
+    while (k >= 0 && t->checkpoints[k]->instrs > instrs) {
+      k--;
+    }
+    if (k < 0) {
+      return 1;
+    }
+
+    for (int i = t->n_checkpoints - 1; i > k; i--) {
+      vm_restore(vm, t->checkpoints[i]);
+      free_snapshot(vm, t->checkpoints[i]);
+    }
+    t->n_checkpoints = k + 1;
+    vm_restore(vm, t->checkpoints[k]);
+    vm->snapshot = t->checkpoints[k];
+    set_page_traps(vm, PAGE_COW, 1);
+    t->next_at = vm->instrs + t->interval;
+    start_replay(vm, k);
+  }
+
+  /**
+   * Re-executed quietly, retaking the checkpoints that were undone and
+   * running on over breakpoints and watches
+   */
+  uint64_t stop_at = vm->stop_at;
+  vm->stop_at = instrs;
+  update_deadline(vm);
+  do {
+    run_blocks(vm, 0, 0, 0);
+  } while (vm->stopped == STOP_BREAKPOINT || vm->stopped == STOP_WATCHPOINT);
+  vm->stop_at = stop_at;
+  vm->stopped = STOP_NONE;
+  vm->pending_stop = STOP_NONE;
+  vm->resume_instrs = vm->instrs;
+  update_deadline(vm);
+  return 0;
+}
+
+/** steps back over the last instruction executed */
+int reverse_step(VM *vm) {
+  return vm->instrs ? vm_seek(vm, vm->instrs - 1) : 1;
+}
+
+/**
+ * Runs backwards to the last breakpoint or watch hit, or else to the
+ * beginning of the history kept. Intervals are searched newest first, each
+ * by re-executing it from its checkpoint.
+ */
+int reverse_continue(VM *vm) {
+  Timeline *t = &vm->timeline;
+  if (!t->n_checkpoints) {
+    return 1;
+  }
+
+  uint64_t limit = vm->instrs;
+  uint64_t stop_at = vm->stop_at;
+  for (;;) {
+    /** re-executing retakes checkpoints and may drop old ones: search */
+    int k = t->n_checkpoints - 1;
+    while (k >= 0 && t->checkpoints[k]->instrs >= limit) {
+      k--;
+    }
+    if (k < 0) {
+      break;
+    }
+    uint64_t from = t->checkpoints[k]->instrs;
+    vm_seek(vm, from);
+    vm->resume_instrs = UINT64_MAX;
+
+    uint64_t last = UINT64_MAX;
+    StopReason reason = STOP_NONE;
+    vm->stop_at = limit;
+    update_deadline(vm);
+    do {
+      run_blocks(vm, 0, 0, 0);
+      if ((vm->stopped == STOP_BREAKPOINT ||
+           vm->stopped == STOP_WATCHPOINT) &&
+          vm->instrs < limit) {
+        last = vm->instrs;
+        reason = vm->stopped;
+      }
+    } while (vm->stopped == STOP_BREAKPOINT ||
+             vm->stopped == STOP_WATCHPOINT);
+    vm->stop_at = stop_at;
+
+    if (reason != STOP_NONE) {
+      vm_seek(vm, last);
+      vm->stopped = reason;
+      return 0;
+    }
+    limit = from;
+  }
+  vm_seek(vm, t->checkpoints[0]->instrs);
+  return 0;
+}
+
+/** one guest program of a batch, as listed in the manifest */
+typedef struct Job {
+  char *path;
+  /** initial values for the registers whose bit is set in init_mask */
+  uint16_t registers[8];
+  uint8_t init_mask;
+} Job;
+
+typedef struct JobResult {
+  size_t job;
+  int loaded;
+  uint16_t registers[8];
+  uint16_t flags;
+  uint64_t clocks;
+  StopReason status;
+} JobResult;
+
+typedef struct Batch Batch;
+
+/**
+ * A batch worker. Its deque of jobs is a range of job indices [head, tail)
+ * packed into one word as tail << 32 | head: the worker pops from the head,
+ * thieves take the upper half with a CAS on the same word. Job indices are
+ * handed out once, so a range can't reappear and there is no ABA.
+ */
+typedef struct Worker {
+  _Alignas(64) _Atomic uint64_t range;
+  pthread_t thread;
+  Batch *batch;
+  size_t id;
+  /** results of the jobs this worker ran, merged after all have joined */
+  JobResult *results;
+  size_t n_results;
+} Worker;
+
+struct Batch {
+  Job *jobs;
+  size_t n_jobs;
+  Worker *workers;
+  size_t n_workers;
+  Cpu cpu;
+  /** per job budget, 0 for none */
+  uint64_t max_instrs;
+  uint64_t max_clocks;
+};
+
+static int reg_by_name(const char *name) {
+  static const char *names[8] = {"ax", "bx", "cx", "dx",
+                                 "sp", "bp", "si", "di"};
+  for (int r = 0; r < 8; r++) {
+    if (strcmp(name, names[r]) == 0) {
+      return r;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Reads a manifest: one job per line, a binary path followed by optional
+ * initial register values, e.g. `listing_0049 cx=3 bx=0x3e8`. Without
+ * `has_path` the lines only hold register values and every job gets `path`.
+ */
+static Job *parse_manifest(FILE *f, size_t *n_jobs, int has_path,
+                           const char *path) {
+  size_t cap = 64;
+  Job *jobs = malloc(cap * sizeof(Job));
+  *n_jobs = 0;
+
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    char *tok = strtok(line, " \t\r\n");
+    if ((tok == NULL && has_path) || (tok && tok[0] == '#')) {
+      continue;
+    }
+
+    if (*n_jobs == cap) {
+      cap *= 2;
+      jobs = realloc(jobs, cap * sizeof(Job));
+    }
+    Job *job = &jobs[(*n_jobs)++];
+    memset(job, 0, sizeof(Job));
+    job->path = strdup(has_path ? tok : path);
+    if (!has_path) {
+      tok = line;
+    }
+
+    for (; tok; tok = strtok(NULL, " \t\r\n")) {
+      char *eq = strchr(tok, '=');
+      if (eq == NULL) {
+        continue;
+      }
+      *eq = '\0';
+      int r = reg_by_name(tok);
+      if (r < 0) {
+        fprintf(stderr, "%s: unknown register %s\n", job->path, tok);
+        continue;
+      }
+      job->registers[r] = strtoul(eq + 1, NULL, 0);
+      job->init_mask |= 1 << r;
+    }
+  }
+
+  return jobs;
+}
+
+static void result_of(VM *vm, JobResult *result) {
+  result->loaded = 1;
+  memcpy(result->registers, vm->registers, sizeof(result->registers));
+  result->flags = vm->flags;
+  result->clocks = vm->clocks;
+}
+
+/**
+ * Bytes a job can have written: its image, plus whatever 16 bit addresses
+ * reach (there are no segment registers, so that's the first 64 KiB + 1)
+ */
+static size_t dirtied_len(int program_len) {
+  return program_len > 0x10001 ? program_len : 0x10001;
+}
+
+/**
+ * Runs one job in a fresh VM on the worker's own memory, which is zero
+ * except for the `*dirty` bytes the previous job may have written
+ */
+static void run_job(Batch *batch, size_t index, unsigned char *memory,
+                    size_t *dirty, JobResult *result) {
+  Job *job = &batch->jobs[index];
+  result->job = index;
+  result->loaded = 0;
+
+  FILE *f = fopen(job->path, "r");
+  if (f == NULL) {
+    return;
+  }
+  memset(memory, 0, *dirty);
+  int program_len = fread(memory, 1, MEMORY_SIZE, f);
+  fclose(f);
+  *dirty = dirtied_len(program_len);
+
+  VM vm = new_vm(memory, program_len);
+  vm.cpu = batch->cpu;
+  for (int r = 0; r < 8; r++) {
+    if (job->init_mask & (1 << r)) {
+      vm.registers[r] = job->registers[r];
+    }
+  }
+  predecode(&vm);
+  set_budget(&vm, batch->max_instrs, batch->max_clocks);
+  result->status = run(&vm);
+  result_of(&vm, result);
+  free_vm(&vm);
+}
+
+static int pop_job(Worker *w, size_t *index) {
+  uint64_t range = atomic_load(&w->range);
+  for (;;) {
+    uint32_t head = range, tail = range >> 32;
+    if (head >= tail) {
+      return 0;
+    }
+    uint64_t next = (uint64_t)tail << 32 | (head + 1);
+    if (atomic_compare_exchange_weak(&w->range, &range, next)) {
+      *index = head;
+      return 1;
+    }
+  }
+}
+
+/** moves the upper half of a victim's range into w's (empty) deque */
+static int steal_jobs(Worker *w, Worker *victim) {
+  uint64_t range = atomic_load(&victim->range);
+  for (;;) {
+    uint32_t head = range, tail = range >> 32;
+    if (head >= tail) {
+      return 0;
+    }
+    uint32_t split = tail - (tail - head + 1) / 2;
+    uint64_t left = (uint64_t)split << 32 | head;
+    if (atomic_compare_exchange_weak(&victim->range, &range, left)) {
+      atomic_store(&w->range, (uint64_t)tail << 32 | split);
+      return 1;
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker *w = arg;
+  Batch *batch = w->batch;
+  unsigned char *memory = calloc(MEMORY_SIZE, 1);
+  size_t dirty = 0;
+  size_t cap_results = 64;
+  w->results = malloc(cap_results * sizeof(JobResult));
+
+  for (;;) {
+    size_t index;
+    while (pop_job(w, &index)) {
+      if (w->n_results == cap_results) {
+        cap_results *= 2;
+        w->results = realloc(w->results, cap_results * sizeof(JobResult));
+      }
+      run_job(batch, index, memory, &dirty, &w->results[w->n_results++]);
+    }
+
+    /** jobs are never added, so once every deque is empty we're done */
+    int stole = 0;
+    for (size_t k = 1; k < batch->n_workers && !stole; k++) {
+      stole = steal_jobs(w, &batch->workers[(w->id + k) % batch->n_workers]);
+    }
+    if (!stole) {
+      break;
+    }
+  }
+
+  free(memory);
+  return NULL;
+}
+
+/** prints a job's final state on the current line; 1 if it didn't run */
+static int print_job_result(JobResult *r) {
+  if (!r->loaded) {
+    printf(" unable to open file\n");
+    return 1;
+  }
+  for (int i = 0; i < 8; i++) {
+    printf(" ");
+    print_reg_by_idx(i);
+    printf(": %d", r->registers[i]);
+  }
+  printf(" SF: %d ZF: %d clocks: %" PRIu64, (r->flags >> 7) & 1,
+         (r->flags >> 6) & 1, r->clocks);
+  if (r->status != STOP_NONE) {
+    printf(" (%s)", stop_reason_name(r->status));
+  }
+  printf("\n");
+  return r->status != STOP_NONE;
+}
+
+/**
+ * Runs every job of the manifest on a pool of n_workers threads and prints
+ * the final state of each, in manifest order
+ */
+int run_batch(const char *manifest_path, size_t n_workers, Cpu cpu,
+              uint64_t max_instrs, uint64_t max_clocks) {
+  FILE *f = fopen(manifest_path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "unable to open file %s\n", manifest_path);
+    return 1;
+  }
+  Batch batch = {
+      .cpu = cpu, .max_instrs = max_instrs, .max_clocks = max_clocks};
+  batch.jobs = parse_manifest(f, &batch.n_jobs, 1, NULL);
+  fclose(f);
+
+  batch.n_workers = n_workers;
+  batch.workers = aligned_alloc(64, n_workers * sizeof(Worker));
+  for (size_t i = 0; i < n_workers; i++) {
+    Worker *w = &batch.workers[i];
+    memset(w, 0, sizeof(Worker));
+    w->batch = &batch;
+    w->id = i;
+    /** start with an even split; stealing evens out the rest */
+    uint64_t head = batch.n_jobs * i / n_workers;
+    uint64_t tail = batch.n_jobs * (i + 1) / n_workers;
+    atomic_init(&w->range, tail << 32 | head);
+  }
+  for (size_t i = 0; i < n_workers; i++) {
+    pthread_create(&batch.workers[i].thread, NULL, worker_main,
+                   &batch.workers[i]);
+  }
+
+  JobResult *results = calloc(batch.n_jobs, sizeof(JobResult));
+  for (size_t i = 0; i < n_workers; i++) {
+    Worker *w = &batch.workers[i];
+    pthread_join(w->thread, NULL);
+    for (size_t k = 0; k < w->n_results; k++) {
+      results[w->results[k].job] = w->results[k];
+    }
+    free(w->results);
+  }
+
+  int failed = 0;
+  for (size_t j = 0; j < batch.n_jobs; j++) {
+    printf("%s:", batch.jobs[j].path);
+    failed |= print_job_result(&results[j]);
+    free(batch.jobs[j].path);
+  }
+
+  free(results);
+  free(batch.jobs);
+  free(batch.workers);
+  return failed;
+}
+
+/**
+ * Guests per lockstep group: as many 16 bit registers as fit one vector
+ * register of the target (build with -mavx2 or -mavx512bw for 16 or 32)
+ */
+#ifndef LANES
+#if defined(__AVX512BW__)
+#define LANES 32
+#elif defined(__AVX2__)
+#define LANES 16
+#else
+#define LANES 8
+#endif
+#endif
+
+typedef uint16_t lanes16 __attribute__((vector_size(2 * LANES)));
+/** per-lane masks: all ones where a lane takes part, as produced by == */
+typedef int16_t mask16 __attribute__((vector_size(2 * LANES)));
+typedef uint64_t lanes64 __attribute__((vector_size(8 * LANES)));
+typedef int64_t mask64 __attribute__((vector_size(8 * LANES)));
+
+/**
+ * LANES guests running the same predecoded program in lockstep, one per
+ * vector lane of the register file. While all lanes are at the same ip they
+ * share `ip`; when a jump splits them each lane gets its own ip in `ips`, the
+ * lanes at the lowest ip execute (with the others masked off) and they
+ * reconverge once all are at the same ip again. Memory operands are not
+ * supported: each lane would need its own memory.
+ */
+typedef struct LockstepVM {
+  VM *program;
+  lanes16 registers[9];
+  lanes16 flags;
+  lanes64 clocks;
+  lanes64 instrs;
+  /** per lane budget, UINT64_MAX for none */
+  uint64_t max_instrs;
+  uint64_t max_clocks;
+  /** lanes holding a guest that hasn't run off the end or stopped */
+  mask16 live;
+  /** why each lane that left live stopped, STOP_NONE at the end */
+  StopReason status[LANES];
+  int diverged;
+  size_t ip;
+  size_t ips[LANES];
+} LockstepVM;
+
+static inline lanes16 blend16(mask16 m, lanes16 new, lanes16 old) {
+  return ((lanes16)m & new) | (~(lanes16)m & old);
+}
+
+static inline int any_lane(mask16 m) {
+  for (int i = 0; i < LANES; i++) {
+    if (m[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static inline lanes16 lockstep_read(LockstepVM *l, int wide, uint8_t slot) {
+  if (wide) {
+    return l->registers[slot];
+  }
+  /** registers8 slots: register * 2 + (high byte) */
+  lanes16 r = l->registers[slot >> 1];
+  return slot & 1 ? r >> 8 : r & 0xFF;
+}
+
+static inline void lockstep_write(LockstepVM *l, int wide, uint8_t slot,
+                                  mask16 m, lanes16 v) {
+  lanes16 *r = &l->registers[wide ? slot : slot >> 1];
+  if (!wide) {
+    v = slot & 1 ? (*r & 0x00FF) | (v << 8) : (*r & 0xFF00) | (v & 0xFF);
+  }
+  *r = blend16(m, v, *r);
+}
+
+/** MOV/ADD/SUB/CMP on register and immediate operands, in the lanes in m */
+static int lockstep_alu(LockstepVM *l, Decoded *d, mask16 m) {
+  int wide = d->shape < R8_R8;
+  Shape shape = wide ? d->shape : d->shape - R8_R8;
+  if (shape != R16_R16 && shape != R16_IMM) {
+    return 0;
+  }
+
+  lanes16 a = lockstep_read(l, wide, d->dst);
+  lanes16 b = shape == R16_IMM ? (lanes16){} + d->imm
+                               : lockstep_read(l, wide, d->src);
+  Op op = d->instr.op_type;
+  lanes16 result = op == MOV ? b : op == ADD ? a + b : a - b;
+  if (op != CMP) {
+    lockstep_write(l, wide, d->dst, m, result);
+  }
+
+  if (op != MOV) {
+    /** as the scalar handlers: see add_BODY */
+    int top = wide ? 15 : 7;
+    if (!wide) {
+      b &= 0xFF;
+    }
+    lanes16 r = wide ? result : result & 0xFF;
+    lanes16 cf = (lanes16)(op == ADD ? r < a : a < b) & 1;
+    lanes16 of = op == ADD ? (a ^ r) & (b ^ r) : (a ^ b) & (a ^ r);
+    lanes16 p = r ^ r >> 4;
+    p ^= p >> 2;
+    p ^= p >> 1;
+    lanes16 zf = (lanes16)(r == 0) & (1 << 6);
+    lanes16 sf = (r >> top & 1) << 7;
+    lanes16 flags = cf | (~p & 1) << 2 | zf | sf | (of >> top & 1) << 11;
+    l->flags = blend16(m, (l->flags & ~0x8C5) | flags, l->flags);
+  }
+  return 1;
+}
+
+/** the lanes of m that take jump d, as its scalar handler decides */
+static mask16 lockstep_taken(LockstepVM *l, Decoded *d, mask16 m) {
+  lanes16 cx = l->registers[2];
+  mask16 zf = (mask16)((l->flags & (1 << 6)) != 0);
+  mask16 sf = (mask16)((l->flags & (1 << 7)) != 0);
+  mask16 cf = (mask16)((l->flags & 1) != 0);
+  mask16 pf = (mask16)((l->flags & (1 << 2)) != 0);
+  mask16 of = (mask16)((l->flags & (1 << 11)) != 0);
+  switch (d->instr.op_type) {
+  case JE:
+    return m & zf;
+  case JNE:
+    return m & ~zf;
+  case JS:
+    return m & sf;
+  case JNS:
+    return m & ~sf;
+  case JL:
+    return m & (sf ^ of);
+  case JNL:
+    return m & ~(sf ^ of);
+  case JLE:
+    return m & ((sf ^ of) | zf);
+  case JNLE:
+    return m & ~((sf ^ of) | zf);
+  case JB:
+    return m & cf;
+  case JNB:
+    return m & ~cf;
+  case JBE:
+    return m & (cf | zf);
+  case JNBE:
+    return m & ~(cf | zf);
+  case JP:
+    return m & pf;
+  case JNP:
+    return m & ~pf;
+  case JO:
+    return m & of;
+  case JNO:
+    return m & ~of;
+  case LOOP:
+    return m & (mask16)(cx != 1);
+  case LOOPZ:
+    return m & (mask16)(cx != 1) & zf;
+  case LOOPNZ:
+    return m & (mask16)(cx != 1) & ~zf;
+  case JCXZ:
+    return m & (mask16)(cx == 0);
+  default:
+    return (mask16){};
+  }
+}
+
+/** takes the lanes in m out of the run, stopped for reason */
+static void lockstep_stop(LockstepVM *l, mask16 m, StopReason reason) {
+  for (int i = 0; i < LANES; i++) {
+    if (m[i]) {
+      l->status[i] = reason;
+    }
+  }
+  l->live &= ~m;
+}
+
+/** the lanes at the lowest ip, and that ip; 0 when all lanes are done */
+static int lockstep_next_lanes(LockstepVM *l, size_t *ip, mask16 *m) {
+  size_t end = l->program->memory_len;
+  size_t lowest = end;
+  for (int i = 0; i < LANES; i++) {
+    if (l->live[i] && l->ips[i] < lowest) {
+      lowest = l->ips[i];
+    }
+  }
+  if (lowest == end) {
+    return 0;
+  }
+
+  int all_there = 1;
+  for (int i = 0; i < LANES; i++) {
+    (*m)[i] = l->live[i] && l->ips[i] == lowest ? -1 : 0;
+    all_there &= !l->live[i] || l->ips[i] >= end || l->ips[i] == lowest;
+  }
+
+  /** reconverged: the lanes still running are all at the same ip */
+  if (all_there) {
+    l->diverged = 0;
+    l->live = *m;
+  }
+  *ip = lowest;
+  return 1;
+}
+
+/**
+ * Runs all lanes to the end of the program, a fault or the budget. Returns 0
+ * when an instruction lockstep can't execute is reached; the lanes' state is
+ * then undefined.
+ */
+static int run_lockstep(LockstepVM *l) {
+  VM *vm = l->program;
+  for (;;) {
+    size_t ip;
+    mask16 m;
+    if (!l->diverged) {
+      if (l->ip >= (size_t)vm->memory_len) {
+        return 1;
+      }
+      ip = l->ip;
+      m = l->live;
+    } else if (!lockstep_next_lanes(l, &ip, &m)) {
+      return 1;
+    }
+
+    /** as in the scalar run: an instruction starts only within budget */
+    mask64 over = (l->instrs >= l->max_instrs) | (l->clocks >= l->max_clocks);
+    mask16 spent = m & __builtin_convertvector(over, mask16);
+    if (any_lane(spent)) {
+      lockstep_stop(l, spent, STOP_BUDGET);
+      m &= ~spent;
+      if (!any_lane(m)) {
+        if (!l->diverged) {
+          return 1;
+        }
+        continue;
+      }
+    }
+
+    Decoded *d = decoded_at(vm, ip);
+    size_t next = ip + d->len;
+    l->clocks += (lanes64)__builtin_convertvector(m, mask64) & d->clocks;
+    l->instrs -= (lanes64)__builtin_convertvector(m, mask64);
+
+    mask16 taken = {};
+    switch (d->instr.op_type) {
+    case MOV:
+    case ADD:
+    case SUB:
+    case CMP:
+      if (!lockstep_alu(l, d, m)) {
+        return 0;
+      }
+      break;
+    case JE:
+    case JL:
+    case JLE:
+    case JB:
+    case JBE:
+    case JP:
+    case JO:
+    case JS:
+    case JNE:
+    case JNL:
+    case JNLE:
+    case JNB:
+    case JNBE:
+    case JNP:
+    case JNO:
+    case JNS:
+    case LOOP:
+    case LOOPZ:
+    case LOOPNZ:
+    case JCXZ:
+      taken = lockstep_taken(l, d, m);
+      if (d->target > (uint32_t)vm->memory_len && any_lane(taken)) {
+        /** as the _out handlers: lanes jumping out fault before the jump */
+        mask64 out = __builtin_convertvector(taken, mask64);
+        l->clocks -= (lanes64)out & d->clocks;
+        l->instrs += (lanes64)out;
+        lockstep_stop(l, taken, STOP_FAULT);
+        m &= ~taken;
+        taken = (mask16){};
+        if (!any_lane(m)) {
+          if (!l->diverged) {
+            return 1;
+          }
+          continue;
+        }
+      }
+      if (d->instr.op_type >= LOOP && d->instr.op_type <= LOOPNZ) {
+        l->registers[2] = blend16(m, l->registers[2] - 1, l->registers[2]);
+      }
+      l->clocks += (lanes64)__builtin_convertvector(taken, mask64) &
+                   d->taken_clocks;
+      break;
+    case IN:
+    case OUT:
+    case INT:
+    case IRET:
+    case PUSH:
+    case POP:
+    case CALL:
+    case RET:
+    case MOVS:
+    case CMPS:
+    case STOS:
+    case LODS:
+    case SCAS:
+    case CLD:
+    case STD:
+    case CLI:
+    case STI:
+    case TEST:
+    case NOT:
+    case NEG:
+    case MUL:
+    case IMUL:
+    case DIV:
+    case IDIV:
+    case ROL:
+    case ROR:
+    case RCL:
+    case RCR:
+    case SHL:
+    case SHR:
+    case SAR:
+    case UNKNOWN_OP:
+      return 0;
+    default:
+      break;
+    }
+
+    if (!any_lane(taken)) {
+      /** no lane jumped: all lanes in m fall through together */
+      if (!l->diverged) {
+        l->ip = next;
+        continue;
+      }
+    } else if (!l->diverged && !any_lane(m & ~taken)) {
+      l->ip = d->target;
+      continue;
+    } else if (!l->diverged) {
+      l->diverged = 1;
+      for (int i = 0; i < LANES; i++) {
+        l->ips[i] = l->ip;
+      }
+    }
+
+    for (int i = 0; i < LANES; i++) {
+      if (m[i]) {
+        l->ips[i] = taken[i] ? d->target : next;
+      }
+    }
+  }
+}
+
+/**
+ * Runs the program at path once per line of the sweep file (initial
+ * register values, as in a batch manifest), LANES runs at a time in
+ * lockstep. Groups that reach an instruction lockstep can't execute are
+ * rerun one guest at a time. Each run stops after max_instrs instructions
+ * or max_clocks clocks (0 for no limit). Nonzero if a run did not reach the
+ * end, as run_batch.
+ */
+int run_sweep(const char *path, const char *sweep_path, Cpu cpu,
+              uint64_t max_instrs, uint64_t max_clocks) {
+  FILE *f = fopen(sweep_path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "unable to open file %s\n", sweep_path);
+    return 1;
+  }
+  Batch batch = {
+      .cpu = cpu, .max_instrs = max_instrs, .max_clocks = max_clocks};
+  batch.jobs = parse_manifest(f, &batch.n_jobs, 0, path);
+  fclose(f);
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "unable to open file %s\n", path);
+    for (size_t j = 0; j < batch.n_jobs; j++) {
+      free(batch.jobs[j].path);
+    }
+    free(batch.jobs);
+    return 1;
+  }
+  unsigned char *memory = calloc(MEMORY_SIZE, 1);
+  int program_len = fread(memory, 1, MEMORY_SIZE, f);
+  fclose(f);
+
+  VM program = new_vm(memory, program_len);
+  predecode(&program);
+  unsigned char *scratch = calloc(MEMORY_SIZE, 1);
+  size_t dirty = 0;
+
+  int failed = 0;
+  for (size_t first = 0; first < batch.n_jobs; first += LANES) {
+    size_t n = batch.n_jobs - first < LANES ? batch.n_jobs - first : LANES;
+    LockstepVM l = {
+        .program = &program,
+        .max_instrs = max_instrs ? max_instrs : UINT64_MAX,
+        .max_clocks = max_clocks ? max_clocks : UINT64_MAX,
+    };
+    for (size_t i = 0; i < n; i++) {
+      l.live[i] = -1;
+      for (int r = 0; r < 8; r++) {
+        l.registers[r][i] = batch.jobs[first + i].registers[r];
+      }
+    }
+
+    JobResult results[LANES];
+    if (run_lockstep(&l)) {
+      for (size_t i = 0; i < n; i++) {
+        results[i].loaded = 1;
+        results[i].status = l.status[i];
+        for (int r = 0; r < 8; r++) {
+          results[i].registers[r] = l.registers[r][i];
+        }
+        results[i].flags = l.flags[i];
+        results[i].clocks = l.clocks[i];
+      }
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        run_job(&batch, first + i, scratch, &dirty, &results[i]);
+      }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      printf("%zu:", first + i);
+      failed |= print_job_result(&results[i]);
+      free(batch.jobs[first + i].path);
+    }
+  }
+
+  free_vm(&program);
+  free(memory);
+  free(scratch);
+  free(batch.jobs);
+  return failed;
+}
+
+/**
+ * Runs the loaded program up to offset fork_at (or its end), snapshots it,
+ * and then runs it to the end once per line of the variants file (initial
+ * register values, as in a batch manifest), restoring the snapshot between
+ * runs. The budget (0 for none) covers each run from the start, shared
+ * prefix included.
+ */
+int run_variants(VM *vm, size_t fork_at, const char *variants_path,
+                 uint64_t max_instrs, uint64_t max_clocks) {
+  FILE *f = fopen(variants_path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "unable to open file %s\n", variants_path);
+    return 1;
+  }
+  size_t n_variants;
+  Job *variants = parse_manifest(f, &n_variants, 0, variants_path);
+  fclose(f);
+
+  set_budget(vm, max_instrs, max_clocks);
+  while (vm->ip < vm->end && (size_t)(vm->ip - vm->memory) != fork_at &&
+         vm->instrs < vm->stop_at && vm->clocks < vm->clock_limit) {
+    step(vm);
+  }
+  Snapshot *s = vm_snapshot(vm);
+
+  for (size_t v = 0; v < n_variants; v++) {
+    vm_restore(vm, s);
+    for (int r = 0; r < 8; r++) {
+      if (variants[v].init_mask & (1 << r)) {
+        vm->registers[r] = variants[v].registers[r];
+      }
+    }
+    JobResult result;
+    result.status = run(vm);
+    result_of(vm, &result);
+    printf("%zu:", v);
+    print_job_result(&result);
+    free(variants[v].path);
+  }
+
+  free_snapshot(vm, s);
+  free(variants);
+  return 0;
+}
+
+#define IMAGE_MAGIC "SIM86IMG"
+#define IMAGE_VERSION 3
+
+/**
+ * Header of an on-disk VM image. It is followed, at page-aligned offsets, by
+ * the 1 MiB of memory and the predecoded instructions, blocks and leaders of
+ * the first memory_len bytes, so an image loads as one private mapping with
+ * nothing to parse or copy.
+ */
+typedef struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  /** layout and build checks for the predecoded sections */
+  uint32_t decoded_size;
+  uint32_t block_size;
+  uint32_t n_handlers;
+  int32_t memory_len;
+  uint16_t registers[8];
+  uint16_t flags;
+  uint64_t ip;
+  uint64_t clocks;
+  uint64_t memory_offset;
+  uint64_t code_offset;
+  uint64_t blocks_offset;
+  uint64_t leaders_offset;
+  /** per predecoded instruction, its handler's index (see image_handler) */
+  uint64_t handlers_offset;
+  uint64_t size;
+} ImageHeader;
+
+static uint64_t page_align(uint64_t n) {
+  return (n + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+/** the handlers not in one of the tables decode_at picks from */
+static const Handler other_handlers[] = {
+    exec_unknown, fault, exec_in, exec_out, exec_int, exec_iret,
+    exec_push_r16, exec_pop_r16, exec_push_mem16, exec_pop_mem16, exec_call,
+    exec_ret, exec_cld, exec_std, exec_cli, exec_sti, exec_nop};
+
+/**
+ * Every handler, in a fixed order. Images save a handler as its index here
+ * (0 for none) rather than as a pointer, so a loaded image can only ever
+ * call one of these.
+ */
+static const struct {
+  const Handler *table;
+  size_t n;
+} image_tables[] = {
+    {&jump_handlers[0][0], sizeof(jump_handlers) / sizeof(Handler)},
+    {&alu_handlers[0][0], sizeof(alu_handlers) / sizeof(Handler)},
+    {&group_handlers[0][0], sizeof(group_handlers) / sizeof(Handler)},
+    {string_handlers, sizeof(string_handlers) / sizeof(Handler)},
+    {other_handlers, sizeof(other_handlers) / sizeof(Handler)},
+};
+
+#define N_IMAGE_TABLES (sizeof(image_tables) / sizeof(image_tables[0]))
+
+/** the number of handler indices, 0 included */
+static uint32_t n_image_handlers(void) {
+  uint32_t n = 1;
+  for (size_t t = 0; t < N_IMAGE_TABLES; t++) {
+    n += image_tables[t].n;
+  }
+  return n;
+}
+
+/** the handler saved as index i; NULL for 0, gaps and out of range */
+static Handler image_handler(uint32_t i) {
+  for (size_t t = 0; t < N_IMAGE_TABLES && i; t++) {
+    if (i - 1 < image_tables[t].n) {
+      return image_tables[t].table[i - 1];
+    }
+    i -= image_tables[t].n;
+  }
+  return NULL;
+}
+
+/** the index image_handler maps back to exec */
+static uint16_t handler_index(Handler exec) {
+  uint32_t i = 1;
+  for (size_t t = 0; exec && t < N_IMAGE_TABLES; t++) {
+    for (size_t k = 0; k < image_tables[t].n; k++, i++) {
+      if (image_tables[t].table[k] == exec) {
+        return i;
+      }
+    }
+  }
+  return 0;
+}
+
+/** whether exec jumps to d->target, which must then lie in the program */
+static int jumps_to_target(Handler exec) {
+  if (exec == exec_call) {
+    return 1;
+  }
+  for (int op = 0; op < UNKNOWN_OP; op++) {
+    if (exec == jump_handlers[op][0]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** whether a page-aligned section of len bytes at offset fits in size */
+static int section_fits(uint64_t offset, uint64_t len, uint64_t size) {
+  return offset % PAGE_SIZE == 0 && offset <= size && len <= size - offset;
+}
+
+static int write_at(FILE *f, uint64_t offset, const void *data, size_t len) {
+  return fseek(f, offset, SEEK_SET) == 0 && fwrite(data, 1, len, f) == len;
+}
+
+/** writes the VM's state, memory and predecoded caches to an image file */
+int save_image(VM *vm, const char *path) {
+  ImageHeader h = {.magic = IMAGE_MAGIC,
+                   .version = IMAGE_VERSION,
+                   .decoded_size = sizeof(Decoded),
+                   .block_size = sizeof(Block),
+                   .n_handlers = n_image_handlers(),
+                   .memory_len = vm->memory_len,
+                   .flags = vm->flags,
+                   .ip = vm->ip - vm->memory,
+                   .clocks = vm->clocks};
+  memcpy(h.registers, vm->registers, sizeof(h.registers));
+
+  size_t n = vm->memory_len;
+  h.memory_offset = page_align(sizeof(h));
+  h.code_offset = page_align(h.memory_offset + MEMORY_SIZE);
+  h.blocks_offset = page_align(h.code_offset + n * sizeof(Decoded));
+  h.leaders_offset = page_align(h.blocks_offset + n * sizeof(Block));
+  h.handlers_offset = page_align(h.leaders_offset + n);
+  h.size = page_align(h.handlers_offset + n * sizeof(uint16_t));
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "unable to open file %s\n", path);
+    return 1;
+  }
+  uint16_t *handlers = malloc(n * sizeof(uint16_t) + 1);
+  for (size_t i = 0; i < n; i++) {
+    handlers[i] = handler_index(vm->code[i].exec);
+  }
+  int ok = write_at(f, 0, &h, sizeof(h)) &&
+           write_at(f, h.memory_offset, vm->memory, MEMORY_SIZE) &&
+           write_at(f, h.code_offset, vm->code, n * sizeof(Decoded)) &&
+           write_at(f, h.blocks_offset, vm->blocks, n * sizeof(Block)) &&
+           write_at(f, h.leaders_offset, vm->leaders, n) &&
+           write_at(f, h.handlers_offset, handlers, n * sizeof(uint16_t)) &&
+           ftruncate(fileno(f), h.size) == 0;
+  free(handlers);
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "unable to write image %s\n", path);
+    return 1;
+  }
+  return 0;
+}
+
+/** whether the predecoded instruction d, run by exec, is one decode_at made */
+static int valid_decoded(VM *vm, Decoded *d, Handler exec) {
+  return exec && d->len >= 1 && d->len <= 6 && d->dst <= ZERO_SLOT &&
+         d->src <= ZERO_SLOT && d->ea_base <= ZERO_SLOT &&
+         d->ea_index <= ZERO_SLOT && d->instr.op_type <= UNKNOWN_OP &&
+         d->shape < N_SHAPES &&
+         (!jumps_to_target(exec) || d->target <= (uint32_t)vm->memory_len);
+}
+
+/** whether the block at offset walks its instructions to its end */
+static int valid_block(VM *vm, const uint16_t *handlers, size_t offset) {
+  Block *b = &vm->blocks[offset];
+  size_t o = offset;
+  uint32_t clocks = 0;
+  for (int n = 0; n < b->n_instrs; n++) {
+    if (o >= (size_t)vm->memory_len || !handlers[o]) {
+      return 0;
+    }
+    clocks += vm->code[o].clocks;
+    o += vm->code[o].len;
+  }
+  return o == b->end && clocks == b->clocks;
+}
+
+/**
+ * Takes the predecoded sections of an image h, after checking them: each
+ * handler index names a handler, the fields handlers index memory and the
+ * registers with are in range, and each block runs to its end. Returns 0,
+ * changing nothing, if any of it is off.
+ */
+static int load_code(VM *vm, char *bytes, ImageHeader *h) {
+  if (h->decoded_size != sizeof(Decoded) || h->block_size != sizeof(Block) ||
+      h->n_handlers != n_image_handlers()) {
+    return 0;
+  }
+  vm->code = (Decoded *)(bytes + h->code_offset);
+  vm->blocks = (Block *)(bytes + h->blocks_offset);
+  vm->leaders = (uint8_t *)(bytes + h->leaders_offset);
+  const uint16_t *handlers = (uint16_t *)(bytes + h->handlers_offset);
+
+  int ok = 1;
+  for (int i = 0; ok && i < vm->memory_len; i++) {
+    ok = (!handlers[i] ||
+          valid_decoded(vm, &vm->code[i], image_handler(handlers[i]))) &&
+         !(vm->leaders[i] & ~(LEADER_JUMP | LEADER_BREAKPOINT)) &&
+         (!vm->blocks[i].n_instrs || valid_block(vm, handlers, i));
+  }
+  if (!ok) {
+    vm->code = NULL;
+    vm->blocks = NULL;
+    vm->leaders = NULL;
+    return 0;
+  }
+
+  /**
+   * Only pointers saved by a binary loaded at another base are written: at
+   * the saving base (a non-PIE build, or without ASLR) the code pages stay
+   * clean, shared with the page cache and every process mapping the image
+   */
+  for (int i = 0; i < vm->memory_len; i++) {
+    Handler exec = image_handler(handlers[i]);
+    if (vm->code[i].exec != exec) {
+      vm->code[i].exec = exec;
+    }
+  }
+  trap_code_pages(vm);
+  return 1;
+}
+
+/**
+ * Loads a VM from an image with a private mapping: pages are read lazily
+ * and writes stay private to this process. Handlers are saved as indices,
+ * mapped back to this binary's; predecoded sections that were saved by a
+ * different build, or fail the checks of load_code, are thrown away and
+ * decoded again. An image whose sections do not fit in the file is
+ * rejected.
+ */
+static int load_image(VM *vm, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "unable to open file %s\n", path);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ImageHeader)) {
+    fprintf(stderr, "%s: not a VM image\n", path);
+    close(fd);
+    return 1;
+  }
+  void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "unable to map %s\n", path);
+    return 1;
+  }
+
+  ImageHeader *h = base;
+  if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != IMAGE_VERSION || h->size > (uint64_t)st.st_size) {
+    fprintf(stderr, "%s: not a VM image\n", path);
+    munmap(base, st.st_size);
+    return 1;
+  }
+  uint64_t n = h->memory_len;
+  if (h->memory_len < 0 || h->memory_len > MEMORY_SIZE ||
+      h->ip > MEMORY_SIZE ||
+      !section_fits(h->memory_offset, MEMORY_SIZE, h->size) ||
+      !section_fits(h->code_offset, n * h->decoded_size, h->size) ||
+      !section_fits(h->blocks_offset, n * h->block_size, h->size) ||
+      !section_fits(h->leaders_offset, n, h->size) ||
+      !section_fits(h->handlers_offset, n * sizeof(uint16_t), h->size)) {
+    fprintf(stderr, "%s: corrupt VM image\n", path);
+    munmap(base, st.st_size);
+    return 1;
+  }
+
+  char *bytes = base;
+  *vm = new_vm((unsigned char *)bytes + h->memory_offset, h->memory_len);
+  vm->image = base;
+  vm->image_len = st.st_size;
+  memcpy(vm->registers, h->registers, sizeof(h->registers));
+  vm->flags = h->flags;
+  vm->ip = vm->memory + h->ip;
+  vm->clocks = h->clocks;
+
+  if (!load_code(vm, bytes, h)) {
+    predecode(vm);
+  }
+  return 0;
+}
+
+/** a VM on a copy of program, loaded at address 0 */
+VM *vm_create(const unsigned char *program, size_t len) {
+  if (len > MEMORY_SIZE) {
+    return NULL;
+  }
+  unsigned char *memory = calloc(MEMORY_SIZE, 1);
+  memcpy(memory, program, len);
+  VM *vm = malloc(sizeof(VM));
+  *vm = new_vm(memory, len);
+  vm->owns_memory = 1;
+  predecode(vm);
+  return vm;
+}
+
+/** a VM on the binary at path */
+VM *vm_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "unable to open file %s\n", path);
+    return NULL;
+  }
+  unsigned char *memory = calloc(MEMORY_SIZE, 1);
+  int program_len = fread(memory, 1, MEMORY_SIZE, f);
+  fclose(f);
+
+  VM *vm = malloc(sizeof(VM));
+  *vm = new_vm(memory, program_len);
+  vm->owns_memory = 1;
+  predecode(vm);
+  return vm;
+}
+
+/** a VM on the image at path written by save_image */
+VM *vm_open_image(const char *path) {
+  VM *vm = malloc(sizeof(VM));
+  if (load_image(vm, path)) {
+    free(vm);
+    return NULL;
+  }
+  return vm;
+}
+
+/** frees the VM and everything enabled on it; an open log is not finished */
+void vm_destroy(VM *vm) {
+  /** first: a replay of the history has the journal swapped out */
+  free_checkpoints(vm);
+  if (vm->journal.f) {
+    fclose(vm->journal.f);
+  }
+  clear_watchpoints(vm);
+  free(vm->profile);
+  free(vm->sampler.hits);
+  free(vm->ports);
+  free(vm->timers.heap);
+  free_callpaths(vm);
+  if (vm->owns_memory) {
+    free(vm->memory);
+  }
+  free_vm(vm);
+  free(vm);
+}
+
+void vm_set_cpu(VM *vm, Cpu cpu) { vm->cpu = cpu; }
+
+/** prints every instruction and the registers it changed while running */
+void vm_set_trace(VM *vm, int trace, int show_clocks) {
+  vm->trace = trace;
+  vm->show_clocks = show_clocks;
+}
+
+/** hook is called after every instruction; NULL removes it */
+void vm_set_instr_hook(VM *vm, InstrHook hook, void *ctx) {
+  vm->hook = hook;
+  vm->hook_ctx = ctx;
+}
+
+/**
+ * Only the instructions runs accepts are executed, the rest just advance
+ * ip; NULL runs them all. The program already decoded is decoded again.
+ */
+void vm_set_instr_filter(VM *vm, InstrFilter runs) {
+  vm->filter = runs;
+  if (vm->memory_len) {
+    note_code_store(vm, 0);
+    note_code_store(vm, vm->memory_len - 1);
+    refresh_code(vm);
+  }
+}
+
+uint16_t vm_reg(VM *vm, size_t index) { return vm->registers[index]; }
+
+void vm_set_reg(VM *vm, size_t index, uint16_t value) {
+  vm->registers[index] = value;
+}
+
+uint16_t vm_flags(VM *vm) { return vm->flags; }
+
+/** ip as an offset into memory */
+size_t vm_ip(VM *vm) { return vm->ip - vm->memory; }
+
+size_t vm_program_len(VM *vm) { return vm->memory_len; }
+
+uint64_t vm_clocks(VM *vm) { return vm->clocks; }
+
+uint64_t vm_instrs(VM *vm) { return vm->instrs; }
+
+/** the 1 MiB address space; stores through it bypass watches and snapshots */
+unsigned char *vm_memory(VM *vm) { return vm->memory; }
+
+StopReason vm_stopped(VM *vm) { return vm->stopped; }
+
+/** prints where and why a run stopped at a breakpoint or watch */
+void report_stop(VM *vm) {
+  if (vm->stopped == STOP_BREAKPOINT) {
+    printf("breakpoint at %td", vm->ip - vm->memory);
+  } else if (vm->stopped == STOP_WATCHPOINT) {
+    printf("watch at %" PRIu32 ": %d -> %d", vm->watch_addr, vm->watch_old,
+           vm->memory[vm->watch_addr]);
+  }
+  printf(" after %" PRIu64 " instructions\n", vm->instrs);
+  dump_registers(vm);
+}
+
+/**
+ * GDB remote serial protocol stub. The packets are handled on their own
+ * thread. While the VM is stopped that thread owns it and serves register
+ * and memory accesses; while it runs, the only thing the stub does to it is
+ * cancel_run on a ^C, which the run loops see through the deadline they
+ * check per block anyway. The VM thread waits for resume commands in
+ * gdb_serve and reports each stop back through a pipe.
+ */
+typedef enum GdbCommand {
+  GDB_NONE,
+  GDB_CONTINUE,
+  GDB_STEP,
+  GDB_REVERSE_STEP,
+  GDB_REVERSE_CONTINUE,
+  /** run on to the end without the debugger */
+  GDB_DETACH,
+  GDB_KILL,
+} GdbCommand;
+
+typedef struct GdbStub {
+  VM *vm;
+  int fd;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t resumed;
+  GdbCommand command;
+  /** the VM thread writes a byte per stop */
+  int stopped[2];
+  /** buffered input from fd */
+  char in[4096];
+  size_t in_pos;
+  size_t in_len;
+  /** the payload of the packet being handled */
+  char packet[8192];
+} GdbStub;
+
+/** gdb's i386 layout: eax ecx edx ebx esp ebp esi edi, then eip eflags */
+static const int gdb_regs[8] = {0, 2, 3, 1, 4, 5, 6, 7};
+#define GDB_N_REGS 16
+
+static int gdb_getc(GdbStub *g) {
+  if (g->in_pos == g->in_len) {
+    ssize_t n = read(g->fd, g->in, sizeof(g->in));
+    if (n <= 0) {
+      return EOF;
+    }
+    g->in_pos = 0;
+    g->in_len = n;
+  }
+  return (unsigned char)g->in[g->in_pos++];
+}
+
+/** reads the next packet's payload into buf; NULL when gdb has gone */
+static char *gdb_read_packet(GdbStub *g, char *buf, size_t size) {
+  for (;;) {
+    int c;
+    do {
+      c = gdb_getc(g);
+      if (c == EOF) {
+        return NULL;
+      }
+    } while (c != '$');
+
+    size_t n = 0;
+    uint8_t sum = 0;
+    while ((c = gdb_getc(g)) != '#' && c != EOF) {
+      sum += c;
+      if (n < size - 1) {
+        buf[n++] = c;
+      }
+    }
+    char check[3] = {gdb_getc(g), gdb_getc(g), 0};
+    buf[n] = 0;
+    if (strtoul(check, NULL, 16) == sum) {
+      write(g->fd, "+", 1);
+      return buf;
+    }
+    write(g->fd, "-", 1);
+  }
+}
+
+static void gdb_send(GdbStub *g, const char *payload) {
+  uint8_t sum = 0;
+  for (const char *p = payload; *p; p++) {
+    sum += *p;
+  }
+  size_t len = strlen(payload);
+  char *packet = malloc(len + 5);
+  sprintf(packet, "$%s#%02x", payload, sum);
+  write(g->fd, packet, len + 4);
+  free(packet);
+}
+
+static void hex_u32(char *out, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    sprintf(out + 2 * i, "%02x", (v >> (8 * i)) & 0xFF);
+  }
+}
+
+static uint32_t parse_u32(const char *hex) {
+  char byte[3] = {0};
+  uint32_t v = 0;
+  for (int i = 0; i < 4 && hex[2 * i] && hex[2 * i + 1]; i++) {
+    byte[0] = hex[2 * i];
+    byte[1] = hex[2 * i + 1];
+    v |= strtoul(byte, NULL, 16) << (8 * i);
+  }
+  return v;
+}
+
+/**
+ * The flags the VM keeps: CF, ZF, SF, IF, DF and OF, at their x86 bits in
+ * vm->flags as in eflags
+ */
+#define GDB_FLAGS (1 | 1 << 2 | 1 << 6 | 1 << 7 | 1 << 9 | 1 << 10 | 1 << 11)
+
+static uint32_t gdb_reg(VM *vm, int n) {
+  if (n < 8) {
+    return vm->registers[gdb_regs[n]];
+  }
+  if (n == 8) {
+    return vm->ip - vm->memory;
+  }
+  return n == 9 ? vm->flags & GDB_FLAGS : 0;
+}
+
+static void gdb_set_reg(VM *vm, int n, uint32_t v) {
+  if (n < 8) {
+    vm->registers[gdb_regs[n]] = v;
+  } else if (n == 8 && v < MEMORY_SIZE) {
+    vm->ip = vm->memory + v;
+  } else if (n == 9) {
+    vm->flags = (vm->flags & ~GDB_FLAGS) | (v & GDB_FLAGS);
+    unmask_irq(vm);
+  }
+}
+
+/**
+ * Stores from the debugger: saved for checkpoints like guest stores, and
+ * code changed under the predecoded instructions is decoded again
+ */
+static void gdb_write_mem(VM *vm, uint32_t addr, uint8_t value) {
+  if (vm->page_traps[addr >> PAGE_SHIFT] & PAGE_COW) {
+    cow_fault(vm, addr >> PAGE_SHIFT);
+  }
+  if (addr < (uint32_t)vm->memory_len && vm->memory[addr] != value) {
+    note_code_store(vm, addr);
+  }
+  vm->memory[addr] = value;
+  if (vm->code_stored) {
+    refresh_code(vm);
+  }
+}
+
+/** hands a resume command to the VM thread */
+static void gdb_resume(GdbStub *g, GdbCommand command) {
+  pthread_mutex_lock(&g->lock);
+  g->command = command;
+  pthread_cond_signal(&g->resumed);
+  pthread_mutex_unlock(&g->lock);
+}
+
+/**
+ * Waits for the VM to stop, turning a ^C from gdb into a stop request, and
+ * sends the stop reply. Returns 0 if gdb went away meanwhile.
+ */
+static int gdb_wait_stop(GdbStub *g) {
+  VM *vm = g->vm;
+  int connected = 1;
+  for (;;) {
+    struct pollfd fds[2] = {{g->stopped[0], POLLIN, 0}, {g->fd, POLLIN, 0}};
+    poll(fds, connected ? 2 : 1, -1);
+    if (fds[0].revents & POLLIN) {
+      char c;
+      read(g->stopped[0], &c, 1);
+      break;
+    }
+    if (fds[1].revents) {
+      int c = gdb_getc(g);
+      if (c == EOF) {
+        connected = 0;
+      }
+      if (c == EOF || c == 0x03) {
+        cancel_run(vm);
+      }
+    }
+  }
+  if (!connected) {
+    return 0;
+  }
+
+  char reply[32];
+  if (vm->ip >= vm->end) {
+    strcpy(reply, "W00");
+  } else if (vm->stopped == STOP_WATCHPOINT) {
+    sprintf(reply, "T05watch:%" PRIx32 ";", vm->watch_addr);
+  } else if (vm->stopped == STOP_CANCELLED) {
+    strcpy(reply, "S02");
+  } else if (vm->stopped == STOP_FAULT) {
+    strcpy(reply, "S04");
+  } else {
+    strcpy(reply, "S05");
+  }
+  gdb_send(g, reply);
+  return vm->ip < vm->end;
+}
+
+/** handles a Z/z packet: breakpoints (0, 1) and write watchpoints (2) */
+static void gdb_break_packet(GdbStub *g, const char *packet) {
+  int type = packet[1] - '0';
+  char *end;
+  uint32_t addr = strtoul(packet + 3, &end, 16);
+  uint32_t len = *end == ',' ? strtoul(end + 1, NULL, 16) : 1;
+  int set = packet[0] == 'Z';
+  VM *vm = g->vm;
+  if ((type == 0 || type == 1) && addr < (uint32_t)vm->memory_len) {
+    if (set) {
+      set_breakpoint(vm, addr);
+    } else {
+      clear_breakpoint(vm, addr);
+    }
+  } else if (type == 2 && addr < MEMORY_SIZE) {
+    if (set) {
+      set_watchpoint(vm, addr, len);
+    } else {
+      clear_watchpoint(vm, addr, len);
+    }
+  } else {
+    gdb_send(g, "");
+    return;
+  }
+  gdb_send(g, "OK");
+}
+
+static void *gdb_main(void *arg) {
+  GdbStub *g = arg;
+  VM *vm = g->vm;
+  char *packet = g->packet;
+  char *reply = malloc(2 * sizeof(g->packet) + 1);
+  GdbCommand last = GDB_DETACH;
+
+  while (gdb_read_packet(g, packet, sizeof(g->packet))) {
+    char *p = packet + 1;
+    reply[0] = 0;
+    switch (packet[0]) {
+    case '?':
+      strcpy(reply, "S05");
+      break;
+    case 'g':
+      for (int n = 0; n < GDB_N_REGS; n++) {
+        hex_u32(reply + 8 * n, gdb_reg(vm, n));
+      }
+      break;
+    case 'G':
+      for (int n = 0; n < GDB_N_REGS && strlen(p) >= 8 * (size_t)(n + 1); n++) {
+        gdb_set_reg(vm, n, parse_u32(p + 8 * n));
+      }
+      strcpy(reply, "OK");
+      break;
+    case 'p':
+      hex_u32(reply, gdb_reg(vm, strtoul(p, NULL, 16)));
+      break;
+    case 'P': {
+      char *value;
+      int n = strtoul(p, &value, 16);
+      if (*value == '=') {
+        gdb_set_reg(vm, n, parse_u32(value + 1));
+      }
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'm': {
+      char *end;
+      uint32_t addr = strtoul(p, &end, 16);
+      uint32_t len = strtoul(end + 1, NULL, 16);
+      for (uint32_t i = 0; i < len && i < sizeof(g->packet) &&
+                           addr + i < MEMORY_SIZE;
+           i++) {
+        sprintf(reply + 2 * i, "%02x", vm->memory[addr + i]);
+      }
+      if (!reply[0]) {
+        strcpy(reply, "E01");
+      }
+      break;
+    }
+    case 'M': {
+      char *end;
+      uint32_t addr = strtoul(p, &end, 16);
+      uint32_t len = strtoul(end + 1, &end, 16);
+      char byte[3] = {0};
+      for (uint32_t i = 0; i < len && addr + i < MEMORY_SIZE && end[1];
+           i++, end += 2) {
+        byte[0] = end[1];
+        byte[1] = end[2];
+        gdb_write_mem(vm, addr + i, strtoul(byte, NULL, 16));
+      }
+      strcpy(reply, "OK");
+      break;
+    }
+    case 'Z':
+    case 'z':
+      gdb_break_packet(g, packet);
+      continue;
+    case 'c':
+    case 's':
+      if (*p) {
+        gdb_set_reg(vm, 8, strtoul(p, NULL, 16));
+      }
+      last = packet[0] == 'c' ? GDB_CONTINUE : GDB_STEP;
+      gdb_resume(g, last);
+      if (!gdb_wait_stop(g)) {
+        goto done;
+      }
+      continue;
+    case 'b':
+      if ((*p == 's' || *p == 'c') && vm->timeline.interval) {
+        gdb_resume(g, *p == 's' ? GDB_REVERSE_STEP : GDB_REVERSE_CONTINUE);
+        gdb_wait_stop(g);
+        continue;
+      }
+      break;
+    case 'q':
+      if (strncmp(p, "Supported", 9) == 0) {
+        sprintf(reply, "PacketSize=%zx%s", sizeof(g->packet),
+                vm->timeline.interval ? ";ReverseStep+;ReverseContinue+"
+                                      : "");
+      } else if (strcmp(p, "Attached") == 0) {
+        strcpy(reply, "1");
+      } else if (strcmp(p, "C") == 0) {
+        strcpy(reply, "QC1");
+      } else if (strcmp(p, "fThreadInfo") == 0) {
+        strcpy(reply, "m1");
+      } else if (strcmp(p, "sThreadInfo") == 0) {
+        strcpy(reply, "l");
+      }
+      break;
+    case 'H':
+    case 'T':
+      strcpy(reply, "OK");
+      break;
+    case 'D':
+      gdb_send(g, "OK");
+      goto done;
+    case 'k':
+      last = GDB_KILL;
+      goto done;
+    }
+    gdb_send(g, reply);
+  }
+
+done:
+  free(reply);
+  gdb_resume(g, last == GDB_KILL ? GDB_KILL : GDB_DETACH);
+  return NULL;
+}
+
+/**
+ * Listens on `address`, a TCP port on localhost or else the path of a Unix
+ * socket, and waits for gdb to connect. Returns the connection, or -1.
+ */
+static int gdb_accept(const char *address) {
+  char *end;
+  long port = strtol(address, &end, 10);
+  int tcp = *end == 0;
+  int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int bound;
+  if (tcp) {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in in = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    bound = bind(fd, (struct sockaddr *)&in, sizeof(in));
+  } else {
+    struct sockaddr_un un = {.sun_family = AF_UNIX};
+    strncpy(un.sun_path, address, sizeof(un.sun_path) - 1);
+    unlink(address);
+    bound = bind(fd, (struct sockaddr *)&un, sizeof(un));
+  }
+  if (bound < 0 || listen(fd, 1) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  fprintf(stderr, "waiting for gdb on %s\n", address);
+  int conn = accept(fd, NULL, NULL);
+  close(fd);
+  if (conn >= 0 && tcp) {
+    int one = 1;
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return conn;
+}
+
+/**
+ * Runs the VM under gdb connected at `address` until gdb kills it or the
+ * program ends; after a detach the program runs on to its end.
+ */
+int gdb_serve(VM *vm, const char *address) {
+  GdbStub g = {.vm = vm, .command = GDB_NONE, .in_pos = 0, .in_len = 0};
+  g.fd = gdb_accept(address);
+  if (g.fd < 0) {
+    fprintf(stderr, "unable to listen for gdb on %s\n", address);
+    return 1;
+  }
+  pipe(g.stopped);
+  pthread_mutex_init(&g.lock, NULL);
+  pthread_cond_init(&g.resumed, NULL);
+  pthread_create(&g.thread, NULL, gdb_main, &g);
+
+  GdbCommand command = GDB_NONE;
+  while (command != GDB_DETACH && command != GDB_KILL) {
+    pthread_mutex_lock(&g.lock);
+    while (g.command == GDB_NONE) {
+      pthread_cond_wait(&g.resumed, &g.lock);
+    }
+    command = g.command;
+    g.command = GDB_NONE;
+    pthread_mutex_unlock(&g.lock);
+
+    if (command == GDB_CONTINUE || command == GDB_DETACH) {
+      do {
+        run(vm);
+      } while (command == GDB_DETACH && (vm->stopped == STOP_BREAKPOINT ||
+                                         vm->stopped == STOP_WATCHPOINT));
+    } else if (command == GDB_STEP) {
+      uint64_t stop_at = vm->stop_at;
+      vm->stop_at = vm->instrs + 1;
+      update_deadline(vm);
+      run(vm);
+      vm->stop_at = stop_at;
+      update_deadline(vm);
+    } else if (command == GDB_REVERSE_STEP) {
+      reverse_step(vm);
+    } else if (command == GDB_REVERSE_CONTINUE) {
+      reverse_continue(vm);
+    }
+    if (command != GDB_DETACH && command != GDB_KILL) {
+      write(g.stopped[1], "", 1);
+    }
+  }
+
+  pthread_join(g.thread, NULL);
+  close(g.fd);
+  close(g.stopped[0]);
+  close(g.stopped[1]);
+  pthread_mutex_destroy(&g.lock);
+  pthread_cond_destroy(&g.resumed);
+  return 0;
+}
+
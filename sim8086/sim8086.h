@@ -0,0 +1,192 @@
+#ifndef _SIM8086_H
+#define _SIM8086_H
+
+/**
+ * sim8086: the 8086 simulator as a library, so that front-ends (the
+ * simulators of the listings, tests, other hosts) share one VM instead of
+ * keeping copies of it. The VM is opaque: it is created, configured, run
+ * and inspected only through the functions below.
+ *
+ * Static library:
+ *   cc -O2 -c sim8086/sim8086.c decoder/decoder.c
+ *   ar rcs libsim8086.a sim8086.o decoder.o
+ * Shared library:
+ *   cc -O2 -fPIC -shared -o libsim8086.so sim8086/sim8086.c decoder/decoder.c
+ * Front-ends link either one with -pthread:
+ *   cc -O2 -o sim 1-8-cond-jumps/sim_cond_jmps.c -L. -lsim8086 -pthread
+ */
+
+#include "../decoder/decoder.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Bus model for the clock estimate. The values are used as a bit mask: a word
+ * transfer costs an extra 4 clocks when (address | cpu) is odd, i.e. at odd
+ * addresses on the 8086's 16 bit bus and always on the 8088's 8 bit bus.
+ */
+typedef enum Cpu {
+  CPU_8086 = 0,
+  CPU_8088 = 1,
+} Cpu;
+
+typedef enum JournalMode {
+  JOURNAL_OFF,
+  JOURNAL_RECORD,
+  JOURNAL_REPLAY,
+} JournalMode;
+
+/** why run returned: the status of a run */
+typedef enum StopReason {
+  /** ran to the end of the program */
+  STOP_NONE,
+  STOP_BREAKPOINT,
+  STOP_WATCHPOINT,
+  /** reached the budget set with set_budget */
+  STOP_BUDGET,
+  /** another thread called cancel_run */
+  STOP_CANCELLED,
+  /** an unknown instruction, or a jump out of the program; ip is at it */
+  STOP_FAULT,
+  /** the guest waits for the host, see vm_waiting; resume with vm_resume */
+  STOP_YIELD,
+} StopReason;
+
+/** what a VM that yielded waits for */
+typedef enum WaitKind {
+  WAIT_NONE,
+  /** the value of an IN: give it with vm_complete_in */
+  WAIT_PORT_IN,
+  /** an OUT has run: the value is in al or ax */
+  WAIT_PORT_OUT,
+  /** an event of the host's, see vm_yield */
+  WAIT_EVENT,
+} WaitKind;
+
+typedef struct VM VM;
+typedef struct Snapshot Snapshot;
+
+/**
+ * Called after every instruction while a hook is set, with the registers
+ * (ax, bx, cx, dx, sp, bp, si, di) as they were before it
+ */
+typedef void (*InstrHook)(VM *vm, const Instruction *instr,
+                          const uint16_t before[8], void *ctx);
+
+/**
+ * Picks the instructions a VM runs; the others only advance ip, like an
+ * earlier stage of the simulator that did not implement them yet
+ */
+typedef int (*InstrFilter)(const Instruction *instr);
+
+/** device callbacks for IN and OUT; `wide` for ax rather than al */
+typedef uint16_t (*PortIn)(VM *vm, uint16_t port, int wide, void *ctx);
+typedef void (*PortOut)(VM *vm, uint16_t port, uint16_t value, int wide,
+                        void *ctx);
+
+/** runs an interrupt in the host instead of a handler in the guest */
+typedef void (*InterruptHandler)(VM *vm, uint8_t vector, void *ctx);
+
+/** device callbacks for loads and stores in memory-mapped pages */
+typedef uint8_t (*MmioRead)(VM *vm, uint32_t addr, void *ctx);
+typedef void (*MmioWrite)(VM *vm, uint32_t addr, uint8_t value, void *ctx);
+
+/** a device event, fired once the clock estimate reaches `at` */
+typedef void (*TimerHandler)(VM *vm, uint64_t at, void *ctx);
+
+/** lifecycle: VMs own their 1 MiB of memory; NULL on errors */
+VM *vm_create(const unsigned char *program, size_t len);
+VM *vm_load(const char *path);
+VM *vm_open_image(const char *path);
+int save_image(VM *vm, const char *path);
+void vm_destroy(VM *vm);
+
+/** configuration */
+void vm_set_cpu(VM *vm, Cpu cpu);
+void vm_set_trace(VM *vm, int trace, int show_clocks);
+void vm_set_instr_hook(VM *vm, InstrHook hook, void *ctx);
+void vm_set_instr_filter(VM *vm, InstrFilter runs);
+void enable_prefetch_model(VM *vm);
+void enable_profile(VM *vm);
+void enable_sampler(VM *vm, uint64_t period, int by_clocks);
+void enable_callpaths(VM *vm);
+
+/** devices */
+void set_port_handler(VM *vm, uint16_t port, PortIn in, PortOut out,
+                      void *ctx);
+void set_default_port_handler(VM *vm, PortIn in, PortOut out, void *ctx);
+void set_interrupt_handler(VM *vm, uint8_t vector, InterruptHandler handler,
+                           void *ctx);
+void set_vector_table(VM *vm, uint16_t addr);
+void map_ram(VM *vm, uint32_t addr, uint32_t len);
+void map_rom(VM *vm, uint32_t addr, uint32_t len);
+void map_mmio(VM *vm, uint32_t addr, uint32_t len, MmioRead read,
+              MmioWrite write, void *ctx);
+void schedule_timer(VM *vm, uint64_t at, TimerHandler fire, void *ctx);
+void cancel_timer(VM *vm, TimerHandler fire, void *ctx);
+
+/** running; cancel_run and request_interrupt may be called from any thread */
+StopReason run(VM *vm);
+void step(VM *vm);
+void set_budget(VM *vm, uint64_t max_instrs, uint64_t max_clocks);
+StopReason vm_resume(VM *vm, uint64_t max_instrs);
+WaitKind vm_waiting(VM *vm, uint16_t *port);
+void vm_complete_in(VM *vm, uint16_t value);
+void vm_yield(VM *vm);
+void cancel_run(VM *vm);
+void request_interrupt(VM *vm, uint8_t vector);
+uint16_t journal_in(VM *vm, uint16_t port,
+                    uint16_t (*read)(VM *vm, uint16_t port));
+const char *stop_reason_name(StopReason reason);
+
+/** state; registers are indexed ax, bx, cx, dx, sp, bp, si, di */
+uint16_t vm_reg(VM *vm, size_t index);
+void vm_set_reg(VM *vm, size_t index, uint16_t value);
+uint16_t vm_flags(VM *vm);
+size_t vm_ip(VM *vm);
+size_t vm_program_len(VM *vm);
+uint64_t vm_clocks(VM *vm);
+uint64_t vm_instrs(VM *vm);
+unsigned char *vm_memory(VM *vm);
+StopReason vm_stopped(VM *vm);
+
+/** debugging */
+void set_breakpoint(VM *vm, size_t offset);
+void clear_breakpoint(VM *vm, size_t offset);
+void set_watchpoint(VM *vm, uint32_t addr, uint32_t len);
+void clear_watchpoint(VM *vm, uint32_t addr, uint32_t len);
+void clear_watchpoints(VM *vm);
+void report_stop(VM *vm);
+int gdb_serve(VM *vm, const char *address);
+
+/** history */
+Snapshot *vm_snapshot(VM *vm);
+void vm_restore(VM *vm, Snapshot *s);
+void free_snapshot(VM *vm, Snapshot *s);
+void enable_checkpoints(VM *vm, uint64_t interval, size_t budget);
+int vm_seek(VM *vm, uint64_t instrs);
+int reverse_step(VM *vm);
+int reverse_continue(VM *vm);
+int journal_open(VM *vm, const char *path, JournalMode mode);
+int journal_close(VM *vm);
+
+/** output */
+void print_reg_by_idx(size_t index);
+void dump_registers(VM *vm);
+void dump_flags(VM *vm);
+void dump_clocks(VM *vm);
+void dump_profile(VM *vm);
+void dump_samples(VM *vm);
+void write_folded(VM *vm, FILE *f);
+
+/** many runs of a program */
+int run_batch(const char *manifest_path, size_t n_workers, Cpu cpu,
+              uint64_t max_instrs, uint64_t max_clocks);
+int run_sweep(const char *path, const char *sweep_path, Cpu cpu,
+              uint64_t max_instrs, uint64_t max_clocks);
+int run_variants(VM *vm, size_t fork_at, const char *variants_path,
+                 uint64_t max_instrs, uint64_t max_clocks);
+
+#endif // _SIM8086_H